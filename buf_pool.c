@@ -0,0 +1,78 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <string.h>
+#include "buf_pool.h"
+
+static int buf_pool_block_used(const buf_pool_t *pool, uint32_t block) {
+    return (pool->used[block >> 5] >> (block & 0x1f)) & 0x01;
+}
+
+static void buf_pool_mark(buf_pool_t *pool, uint32_t first_block, uint32_t blocks, int used) {
+    for (uint32_t block = first_block; block < first_block + blocks; block++) {
+        if (used) {
+            pool->used[block >> 5] |= (1UL << (block & 0x1f));
+        } else {
+            pool->used[block >> 5] &= ~(1UL << (block & 0x1f));
+        }
+    }
+}
+
+void buf_pool_init(buf_pool_t *pool, uint8_t *data, size_t size) {
+    uint32_t num_blocks = size / BUF_POOL_BLOCK_SIZE;
+    if (num_blocks > BUF_POOL_MAX_BLOCKS) {
+        num_blocks = BUF_POOL_MAX_BLOCKS;
+    }
+    memset(pool, 0, sizeof(*pool));
+    pool->data = data;
+    pool->num_blocks = num_blocks;
+    pool->free_blocks = num_blocks;
+}
+
+uint8_t *buf_pool_alloc(buf_pool_t *pool, size_t size) {
+    uint32_t blocks = (size + BUF_POOL_BLOCK_SIZE - 1) / BUF_POOL_BLOCK_SIZE;
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    uint32_t block = 0;
+    if ((blocks == 0) || (blocks > pool->free_blocks)) {
+        return 0;
+    }
+    while (block < pool->num_blocks) {
+        if (((block & 0x1f) == 0) && (pool->used[block >> 5] == 0xffffffffUL)) {
+            /* Skip fully used bitmap words */
+            block += 32;
+            run_length = 0;
+            continue;
+        }
+        if (buf_pool_block_used(pool, block)) {
+            run_length = 0;
+        } else {
+            if (run_length == 0) {
+                run_start = block;
+            }
+            if (++run_length == blocks) {
+                buf_pool_mark(pool, run_start, blocks, 1);
+                pool->free_blocks -= blocks;
+                return &pool->data[run_start * BUF_POOL_BLOCK_SIZE];
+            }
+        }
+        block++;
+    }
+    return 0;
+}
+
+void buf_pool_free(buf_pool_t *pool, uint8_t *buf, size_t size) {
+    uint32_t blocks = (size + BUF_POOL_BLOCK_SIZE - 1) / BUF_POOL_BLOCK_SIZE;
+    uint32_t first_block = (buf - pool->data) / BUF_POOL_BLOCK_SIZE;
+    if (buf && blocks) {
+        buf_pool_mark(pool, first_block, blocks, 0);
+        pool->free_blocks += blocks;
+    }
+}
+
+size_t buf_pool_free_size(const buf_pool_t *pool) {
+    return pool->free_blocks * BUF_POOL_BLOCK_SIZE;
+}
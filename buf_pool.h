@@ -0,0 +1,39 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block pool for port buffers. The pool memory is split into fixed size
+ * blocks tracked by a bitmap, a buffer is a run of contiguous blocks so
+ * it can be used as a DMA target. Allocation is first-fit. Not interrupt
+ * safe, the pool is only changed from the main loop.
+ */
+
+#define BUF_POOL_BLOCK_SIZE     64
+#define BUF_POOL_MAX_BLOCKS     256
+
+typedef struct {
+    uint8_t     *data;
+    uint32_t    num_blocks;
+    uint32_t    free_blocks;
+    uint32_t    used[BUF_POOL_MAX_BLOCKS / 32];
+} buf_pool_t;
+
+void buf_pool_init(buf_pool_t *pool, uint8_t *data, size_t size);
+
+/* size is rounded up to whole blocks, returns 0 if no free run is large enough */
+uint8_t *buf_pool_alloc(buf_pool_t *pool, size_t size);
+void buf_pool_free(buf_pool_t *pool, uint8_t *buf, size_t size);
+
+/* Returns free pool memory in bytes */
+size_t buf_pool_free_size(const buf_pool_t *pool);
+
+#endif /* BUF_POOL_H */
@@ -12,10 +12,17 @@
 
 typedef struct {
     gpio_pin_t pins[cdc_pin_last];
+    uint16_t   rx_buf_size; /* UART RX -> USB IN, bytes, power of 2 */
+    uint16_t   tx_buf_size; /* USB OUT -> UART TX, bytes, power of 2 */
 } __attribute__ ((packed)) cdc_port_t;
 
 typedef struct {
     cdc_port_t port_config[USB_CDC_NUM_PORTS];
 } __attribute__ ((packed)) cdc_config_t;
 
+/* Port Buffer Sizes, carved from the buffer arena on USB reset */
+
+int usb_cdc_buf_config_valid(const cdc_config_t *cdc_config);
+size_t usb_cdc_buf_config_used(const cdc_config_t *cdc_config);
+
 #endif /* CDC_CONFIG_H */
@@ -13,6 +13,10 @@
 #include "cdc_config.h"
 #include "device_config.h"
 #include "version.h"
+#include "system_profile.h"
+#include "system_load.h"
+#include "usb_trace.h"
+#include "usb_descriptors.h"
 #include "cdc_shell.h"
 
 
@@ -352,6 +356,381 @@ static void cdc_shell_cmd_config(int argc, char *argv[]) {
     cdc_shell_write_string(cdc_shell_err_config_missing_arguments);
 }
 
+/* Statistics Commands */
+
+static const char cdc_shell_err_stats_missing_arguments[] = "Error, invalid or missing arguments, use \"help stats\" for the list of arguments.\r\n";
+
+static int cdc_shell_parse_port(const char *arg) {
+    int port;
+    if (strcmp(arg, "all") == 0) {
+        return -1;
+    }
+    if (((port = atoi(arg)) < 1) || port > USB_CDC_NUM_PORTS) {
+        return -2;
+    }
+    return port - 1;
+}
+
+static void cdc_shell_write_port_header(int port) {
+    char port_index_str[32];
+    snprintf(port_index_str, sizeof(port_index_str), "UART%u:", port + 1);
+    cdc_shell_write_string(port_index_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_write_counter(const char *name, uint32_t value, const char *unit) {
+    char value_str[32];
+    snprintf(value_str, sizeof(value_str), "%lu", (unsigned long)value);
+    cdc_shell_write_string(name);
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(value_str);
+    if (unit) {
+        cdc_shell_write_string(unit);
+    }
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_write_rx_errors(const usb_cdc_port_stats_t *stats) {
+    char errors_str[80];
+    snprintf(errors_str, sizeof(errors_str), "parity %lu, framing %lu, noise %lu, overrun %lu",
+             (unsigned long)stats->rx_parity_errors, (unsigned long)stats->rx_framing_errors,
+             (unsigned long)stats->rx_noise_errors, (unsigned long)stats->rx_usart_overruns);
+    cdc_shell_write_string("rx errors");
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(errors_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_write_rx_overruns(const usb_cdc_port_stats_t *stats) {
+    char overruns_str[48];
+    snprintf(overruns_str, sizeof(overruns_str), "%lu, %lu bytes lost",
+             (unsigned long)stats->rx_overruns, (unsigned long)stats->rx_overrun_bytes);
+    cdc_shell_write_string("rx overruns");
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(overruns_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_write_rx_buf_resizes(const usb_cdc_port_stats_t *stats) {
+    char resizes_str[64];
+    snprintf(resizes_str, sizeof(resizes_str), "grows %lu, shrinks %lu, failures %lu",
+             (unsigned long)stats->rx_buf_grows, (unsigned long)stats->rx_buf_shrinks,
+             (unsigned long)stats->rx_buf_grow_failures);
+    cdc_shell_write_string("rx buffer resizes");
+    cdc_shell_write_string(cdc_shell_delim);
+    cdc_shell_write_string(resizes_str);
+    cdc_shell_write_string(cdc_shell_new_line);
+}
+
+static void cdc_shell_cmd_stats_show(int port) {
+    const char *bytes_str = " bytes";
+    const char *rate_str = " bytes/s";
+    cdc_shell_write_port_header(port);
+    const usb_cdc_port_stats_t *stats = usb_cdc_get_port_stats(port);
+    cdc_shell_write_counter("rx", stats->rx_bytes, bytes_str);
+    cdc_shell_write_counter("rx rate", stats->rx_rate, rate_str);
+    cdc_shell_write_counter("tx", stats->tx_bytes, bytes_str);
+    cdc_shell_write_counter("tx rate", stats->tx_rate, rate_str);
+    cdc_shell_write_rx_overruns(stats);
+    cdc_shell_write_rx_errors(stats);
+    cdc_shell_write_counter("rx buffer peak", stats->rx_buf_peak, bytes_str);
+    cdc_shell_write_counter("tx buffer peak", stats->tx_buf_peak, bytes_str);
+    cdc_shell_write_counter("usb rx deferred", stats->rx_deferred, 0);
+    cdc_shell_write_counter("rts throttled", stats->rts_throttled, 0);
+    cdc_shell_write_counter("zlps sent", stats->rx_zlps, 0);
+    cdc_shell_write_rx_buf_resizes(stats);
+}
+
+static void cdc_shell_cmd_stats(int argc, char *argv[]) {
+    if (argc == 1 || argc == 2) {
+        int port = cdc_shell_parse_port(argv[0]);
+        int reset = 0;
+        if (port == -2) {
+            cdc_shell_write_string(cdc_shell_err_uart_invalid_uart);
+            return;
+        }
+        if (argc == 2) {
+            if (strcmp(argv[1], "reset") != 0) {
+                cdc_shell_write_string(cdc_shell_err_stats_missing_arguments);
+                return;
+            }
+            reset = 1;
+        }
+        for (int port_index = ((port == -1) ? 0 : port);
+                 port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+                 port_index++) {
+            if (reset) {
+                usb_cdc_reset_port_stats(port_index);
+            } else {
+                cdc_shell_cmd_stats_show(port_index);
+            }
+        }
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_stats_missing_arguments);
+}
+
+/* Port Buffer Commands */
+
+static const char cdc_shell_err_buffer_missing_arguments[] = "Error, invalid or missing arguments, use \"help buffer\" for the list of arguments.\r\n";
+static const char cdc_shell_err_buffer_invalid_size[] = "Error, invalid buffer size, use \"help buffer\" for the size limits.\r\n";
+
+static void cdc_shell_cmd_buffer_show(int port) {
+    const char *bytes_str = " bytes";
+    const cdc_port_t *port_config = &device_config_get()->cdc_config.port_config[port];
+    cdc_shell_write_port_header(port);
+    cdc_shell_write_counter("rx", port_config->rx_buf_size, bytes_str);
+    cdc_shell_write_counter("rx now", usb_cdc_get_port_rx_buf_size(port), bytes_str);
+    cdc_shell_write_counter("tx", port_config->tx_buf_size, bytes_str);
+}
+
+static void cdc_shell_cmd_buffer(int argc, char *argv[]) {
+    if (argc >= 2) {
+        int port = cdc_shell_parse_port(argv[0]);
+        if (port == -2) {
+            cdc_shell_write_string(cdc_shell_err_uart_invalid_uart);
+            return;
+        }
+        if (argc == 2 && strcmp(argv[1], "show") == 0) {
+            const char *bytes_str = " bytes";
+            for (int port_index = ((port == -1) ? 0 : port);
+                     port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+                     port_index++) {
+                cdc_shell_cmd_buffer_show(port_index);
+            }
+            cdc_shell_write_counter("arena used", usb_cdc_buf_config_used(&device_config_get()->cdc_config), bytes_str);
+            cdc_shell_write_counter("arena size", USB_CDC_BUF_ARENA_SIZE, bytes_str);
+            cdc_shell_write_counter("arena free now", usb_cdc_get_buf_pool_free(), bytes_str);
+            return;
+        }
+        if (argc % 2) {
+            cdc_config_t cdc_config = device_config_get()->cdc_config;
+            for (int arg = 1; arg < argc; arg += 2) {
+                int rx = (strcmp(argv[arg], "rx") == 0);
+                int size = atoi(argv[arg + 1]);
+                if (!rx && strcmp(argv[arg], "tx") != 0) {
+                    cdc_shell_write_string(cdc_shell_err_buffer_missing_arguments);
+                    return;
+                }
+                if ((size <= 0) || (size > USB_CDC_BUF_ARENA_SIZE)) {
+                    cdc_shell_write_string(cdc_shell_err_buffer_invalid_size);
+                    return;
+                }
+                for (int port_index = ((port == -1) ? 0 : port);
+                         port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+                         port_index++) {
+                    if (rx) {
+                        cdc_config.port_config[port_index].rx_buf_size = size;
+                    } else {
+                        cdc_config.port_config[port_index].tx_buf_size = size;
+                    }
+                }
+            }
+            if (!usb_cdc_buf_config_valid(&cdc_config)) {
+                cdc_shell_write_string(cdc_shell_err_buffer_invalid_size);
+                return;
+            }
+            device_config_get()->cdc_config = cdc_config;
+            return;
+        }
+    }
+    cdc_shell_write_string(cdc_shell_err_buffer_missing_arguments);
+}
+
+/* RX Latency Commands */
+
+static const char cdc_shell_err_latency_missing_arguments[] = "Error, invalid or missing arguments, use \"help latency\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_latency_show(int port) {
+    const usb_cdc_rx_latency_t *rx_latency = usb_cdc_get_port_rx_latency(port);
+    const char *us_str = " us";
+    cdc_shell_write_port_header(port);
+    for (int bucket = 0; bucket < USB_CDC_RX_LATENCY_BUCKETS; bucket++) {
+        char range_str[32];
+        unsigned long range_low = (bucket == 0) ? 0 : (1UL << bucket);
+        unsigned long range_high = (1UL << (bucket + 1)) - 1;
+        if (rx_latency->buckets[bucket] == 0) {
+            continue;
+        }
+        if (bucket == (USB_CDC_RX_LATENCY_BUCKETS - 1)) {
+            snprintf(range_str, sizeof(range_str), "%lu+ us", range_low);
+        } else {
+            snprintf(range_str, sizeof(range_str), "%lu-%lu us", range_low, range_high);
+        }
+        cdc_shell_write_counter(range_str, rx_latency->buckets[bucket], 0);
+    }
+    cdc_shell_write_counter("max", rx_latency->max_us, us_str);
+}
+
+static void cdc_shell_cmd_latency(int argc, char *argv[]) {
+    if (argc == 1 || argc == 2) {
+        int port = cdc_shell_parse_port(argv[0]);
+        int reset = 0;
+        if (port == -2) {
+            cdc_shell_write_string(cdc_shell_err_uart_invalid_uart);
+            return;
+        }
+        if (argc == 2) {
+            if (strcmp(argv[1], "reset") != 0) {
+                cdc_shell_write_string(cdc_shell_err_latency_missing_arguments);
+                return;
+            }
+            reset = 1;
+        }
+        for (int port_index = ((port == -1) ? 0 : port);
+                 port_index < ((port == -1) ? USB_CDC_NUM_PORTS : port + 1);
+                 port_index++) {
+            if (reset) {
+                usb_cdc_reset_port_rx_latency(port_index);
+            } else {
+                cdc_shell_cmd_latency_show(port_index);
+            }
+        }
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_latency_missing_arguments);
+}
+
+/* CPU Load Commands */
+
+static const char cdc_shell_err_load_missing_arguments[] = "Error, invalid or missing arguments, use \"help load\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_load(int argc, char *argv[]) {
+    const char *percent_str = "%";
+    if (argc == 0) {
+        cdc_shell_write_counter("load", system_load_get(), percent_str);
+        cdc_shell_write_counter("peak", system_load_get_peak(), percent_str);
+        return;
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        system_load_reset_peak();
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_load_missing_arguments);
+}
+
+/* USB Trace Commands */
+
+#define CDC_SHELL_TRACE_SHOW_ENTRIES 32
+
+static const char cdc_shell_err_trace_missing_arguments[] = "Error, invalid or missing arguments, use \"help trace\" for the list of arguments.\r\n";
+
+static const char *cdc_shell_trace_events[] = {
+    [usb_trace_event_data_received] = "rx",
+    [usb_trace_event_data_sent]     = "tx",
+    [usb_trace_event_setup]         = "setup",
+    [usb_trace_event_reset]         = "reset",
+    [usb_trace_event_suspend]       = "suspend",
+    [usb_trace_event_wakeup]        = "wakeup",
+};
+
+static void cdc_shell_cmd_trace_show(size_t first_index) {
+    size_t trace_count = usb_trace_count();
+    size_t last_index = first_index + CDC_SHELL_TRACE_SHOW_ENTRIES;
+    char entry_str[48];
+    if (last_index > trace_count) {
+        last_index = trace_count;
+    }
+    cdc_shell_write_counter("entries", trace_count, 0);
+    for (size_t index = first_index; index < last_index; index++) {
+        const usb_trace_entry_t *entry = usb_trace_get(index);
+        const char *event_str = (entry->event < (sizeof(cdc_shell_trace_events) / sizeof(*cdc_shell_trace_events)) &&
+                                 cdc_shell_trace_events[entry->event]) ? cdc_shell_trace_events[entry->event] : "?";
+        snprintf(entry_str, sizeof(entry_str), "%u\t%u\t%s\tep%u\t%u",
+                 (unsigned)index, (unsigned)entry->frame, event_str, (unsigned)entry->ep, (unsigned)entry->count);
+        cdc_shell_write_string(entry_str);
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+static void cdc_shell_cmd_trace(int argc, char *argv[]) {
+    if (argc == 1) {
+        if (strcmp(argv[0], "start") == 0) {
+            usb_trace_start();
+            return;
+        } else if (strcmp(argv[0], "stop") == 0) {
+            usb_trace_stop();
+            return;
+        } else if (strcmp(argv[0], "clear") == 0) {
+            usb_trace_clear();
+            return;
+        } else if (strcmp(argv[0], "status") == 0) {
+            cdc_shell_write_string("recording");
+            cdc_shell_write_string(cdc_shell_delim);
+            cdc_shell_write_string(usb_trace_is_running() ? "on" : "off");
+            cdc_shell_write_string(cdc_shell_new_line);
+            cdc_shell_write_counter("entries", usb_trace_count(), 0);
+            return;
+        }
+    }
+    if ((argc == 1 || argc == 2) && (strcmp(argv[0], "show") == 0)) {
+        /* Do not trace the shell output itself */
+        usb_trace_stop();
+        cdc_shell_cmd_trace_show((argc == 2) ? atoi(argv[1]) : 0);
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_trace_missing_arguments);
+}
+
+/* USB Transfer Commands */
+
+static const char cdc_shell_err_usb_missing_arguments[] = "Error, invalid or missing arguments, use \"help usb\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_usb(int argc, char *argv[]) {
+    const usb_io_stats_t *usb_stats = usb_io_get_stats();
+    if (argc == 0) {
+        cdc_shell_write_counter("packets per frame peak", usb_stats->frame_packets_peak, 0);
+        cdc_shell_write_counter("packets per poll peak", usb_stats->poll_packets_peak, 0);
+        return;
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        usb_io_reset_stats();
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_usb_missing_arguments);
+}
+
+/* USB Packet Memory Commands */
+
+static void cdc_shell_cmd_pma(int argc, char *argv[]) {
+    const char *bytes_str = " bytes";
+    cdc_shell_write_counter("size", USB_PMA_SIZE, bytes_str);
+    cdc_shell_write_counter("used", USB_PMA_SIZE - usb_pma_slack, bytes_str);
+    cdc_shell_write_counter("free", usb_pma_slack, bytes_str);
+}
+
+#if defined(SYSTEM_PROFILE)
+
+/* Profiling Commands */
+
+static const char cdc_shell_err_perf_missing_arguments[] = "Error, invalid or missing arguments, use \"help perf\" for the list of arguments.\r\n";
+
+static void cdc_shell_cmd_perf_show() {
+    for (system_profile_point_t point = 0; point < system_profile_point_last; point++) {
+        const system_profile_counter_t *counter = system_profile_get(point);
+        char counter_str[64];
+        uint32_t avg_cycles = counter->calls ? (uint32_t)(counter->total_cycles / counter->calls) : 0;
+        snprintf(counter_str, sizeof(counter_str), "%lu calls, %lu/%lu/%lu cycles",
+                 (unsigned long)counter->calls, (unsigned long)counter->min_cycles,
+                 (unsigned long)avg_cycles, (unsigned long)counter->max_cycles);
+        cdc_shell_write_string(system_profile_get_name(point));
+        cdc_shell_write_string(cdc_shell_delim);
+        cdc_shell_write_string(counter_str);
+        cdc_shell_write_string(cdc_shell_new_line);
+    }
+}
+
+static void cdc_shell_cmd_perf(int argc, char *argv[]) {
+    if (argc == 0) {
+        cdc_shell_cmd_perf_show();
+        return;
+    } else if (argc == 1 && strcmp(argv[0], "reset") == 0) {
+        system_profile_reset();
+        return;
+    }
+    cdc_shell_write_string(cdc_shell_err_perf_missing_arguments);
+}
+
+#endif /* SYSTEM_PROFILE */
+
 static const char cdc_shell_device_version[]            = DEVICE_VERSION_STRING;
 
 static void cdc_shell_cmd_version(int argc, char *argv[]) {
@@ -391,6 +770,82 @@ static const cdc_shell_cmd_t cdc_shell_commands[] = {
                           "Example: \"uart 1 tx output od\" sets UART1 TX output type to open-drain\r\n"
                           "Example: \"uart 3 rts active high dcd active high pull down\" allows to set multiple parameters at once.",
     },
+    {
+        .cmd            = "stats",
+        .handler        = cdc_shell_cmd_stats,
+        .description    = "show and reset UART traffic statistics",
+        .usage          = "Usage: stats port-number|all [reset]\r\n"
+                          "Use \"stats port-number|all\" to view byte counters, transfer rates, overruns,\r\n"
+                          "buffer peaks and flow control counters.\r\n"
+                          "Use \"stats port-number|all reset\" to clear the counters.\r\n"
+                          "Rates are averaged over the last second.",
+    },
+    {
+        .cmd            = "buffer",
+        .handler        = cdc_shell_cmd_buffer,
+        .description    = "set and view UART buffer sizes",
+        .usage          = "Usage: buffer port-number|all show|rx|tx size [rx|tx size]\r\n"
+                          "Use \"buffer port-number|all show\" to view buffer sizes and the buffer arena usage,\r\n"
+                          "\"rx now\" is the current RX buffer size, RX buffers borrow free arena memory when busy.\r\n"
+                          "Use \"buffer port-number|all rx|tx size [rx|tx size]\" to set RX (UART to USB)\r\n"
+                          "and TX (USB to UART) buffer sizes in bytes. Sizes are powers of 2, at least 64 bytes\r\n"
+                          "(1024 bytes for UART1 rx), all buffers together must fit the buffer arena.\r\n"
+                          "New sizes take effect after the device is reconnected, use \"config save\" to keep them.\r\n"
+                          "Example: \"buffer 2 rx 4096 tx 64\" sets a deep RX buffer for a fast sensor on UART2.",
+    },
+    {
+        .cmd            = "latency",
+        .handler        = cdc_shell_cmd_latency,
+        .description    = "show and reset UART RX to USB latency histogram",
+        .usage          = "Usage: latency port-number|all [reset]\r\n"
+                          "Use \"latency port-number|all\" to view the histogram of the time received data\r\n"
+                          "spends in the device before it is passed to the USB endpoint.\r\n"
+                          "Use \"latency port-number|all reset\" to clear the histogram.",
+    },
+    {
+        .cmd            = "load",
+        .handler        = cdc_shell_cmd_load,
+        .description    = "show CPU utilization",
+        .usage          = "Usage: load [reset]\r\n"
+                          "Use \"load\" to view CPU utilization over the last second and its peak value.\r\n"
+                          "Use \"load reset\" to reset the peak value.",
+    },
+    {
+        .cmd            = "trace",
+        .handler        = cdc_shell_cmd_trace,
+        .description    = "record and view USB events",
+        .usage          = "Usage: trace start|stop|clear|status|show [first-entry]\r\n"
+                          "Use \"trace start\" and \"trace stop\" to control recording, it is on after reset.\r\n"
+                          "Use \"trace clear\" to discard recorded events.\r\n"
+                          "Use \"trace status\" to check whether recording is on and how many events are kept.\r\n"
+                          "Use \"trace show [first-entry]\" to stop recording and view up to 32 events,\r\n"
+                          "oldest first, as: entry frame event endpoint byte-count.",
+    },
+    {
+        .cmd            = "usb",
+        .handler        = cdc_shell_cmd_usb,
+        .description    = "show and reset USB transfer counters",
+        .usage          = "Usage: usb [reset]\r\n"
+                          "Use \"usb\" to view the peak number of transfers completed within a 1 ms frame\r\n"
+                          "and serviced by a single polling pass.\r\n"
+                          "Use \"usb reset\" to clear the peaks.",
+    },
+    {
+        .cmd            = "pma",
+        .handler        = cdc_shell_cmd_pma,
+        .description    = "show USB packet memory usage",
+        .usage          = "Usage: pma",
+    },
+#if defined(SYSTEM_PROFILE)
+    {
+        .cmd            = "perf",
+        .handler        = cdc_shell_cmd_perf,
+        .description    = "show and reset handler execution time profile",
+        .usage          = "Usage: perf [reset]\r\n"
+                          "Use \"perf\" to view call counts and min/avg/max CPU cycles of each handler.\r\n"
+                          "Use \"perf reset\" to clear the profile.",
+    },
+#endif /* SYSTEM_PROFILE */
     {
         .cmd            = "version",
         .handler        = cdc_shell_cmd_version,
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "stm32f10x.h"
 #include <limits.h>
+#include "system_ramfunc.h"
 #include "device_config.h"
 
 #define DEVICE_CONFIG_FLASH_SIZE    0x10000UL
@@ -14,7 +15,7 @@
 #define DEVICE_CONFIG_PAGE_SIZE     0x400UL
 #define DEVICE_CONFIG_FLASH_END     (FLASH_BASE + DEVICE_CONFIG_FLASH_SIZE)
 #define DEVICE_CONFIG_BASE_ADDR     ((void*)(DEVICE_CONFIG_FLASH_END - DEVICE_CONFIG_NUM_PAGES * DEVICE_CONFIG_PAGE_SIZE))
-#define DEVICE_CONFIG_MAGIC         0xDECFDECFUL
+#define DEVICE_CONFIG_MAGIC         0xDECFDEC0UL
 
 static const device_config_t default_device_config = {
     .status_led_pin = { .port = GPIOB, .pin = 7, .dir = gpio_dir_output, .speed = gpio_speed_low, .func = gpio_func_general, .output = gpio_output_od, .polarity = gpio_polarity_low },
@@ -34,7 +35,9 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin = 15, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOB, .pin =  3, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOB, .pin =  0, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
             /*  Port 1 */
             {
@@ -49,7 +52,9 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin =  8, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOB, .pin = 12, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOB, .pin =  1, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
             /*  Port 2 */
             {
@@ -64,7 +69,9 @@ static const device_config_t default_device_config = {
                     /* dcd */ { .port = GPIOB, .pin =  8, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /*  ri */ { .port = GPIOA, .pin =  8, .dir = gpio_dir_input,  .pull = gpio_pull_up, .polarity = gpio_polarity_low },
                     /* txa */ { .port = GPIOA, .pin =  7, .dir = gpio_dir_output, .speed = gpio_speed_medium, .func = gpio_func_general, .output = gpio_output_pp, .polarity = gpio_polarity_high  },
-                }
+                },
+                .rx_buf_size = USB_CDC_BUF_SIZE,
+                .tx_buf_size = USB_CDC_BUF_SIZE,
             },
         }
     }
@@ -115,7 +122,7 @@ void device_config_init() {
     }
     memcpy(&current_device_config, stored_config, sizeof(*stored_config));
 }
-device_config_t *device_config_get() {
+RAMFUNC device_config_t *device_config_get() {
     return &current_device_config;
 }
 
@@ -4,6 +4,7 @@
  * Copyright (c) 2020 Kirill Kotyagin
  */
 
+#include "system_ramfunc.h"
 #include "gpio.h"
 #define GPIO_BSRR_BR0_Pos                    (16U)                             
 
@@ -50,7 +51,7 @@ void gpio_pin_init(const gpio_pin_t *pin) {
     }
 }
 
-void gpio_pin_set(const gpio_pin_t *pin, int is_active) {
+RAMFUNC void gpio_pin_set(const gpio_pin_t *pin, int is_active) {
     if (pin->port) {
         pin->port->BSRR = (GPIO_BSRR_BS0 << pin->pin) 
             << (!!is_active != (pin->polarity == gpio_polarity_low) ? 0 : GPIO_BSRR_BR0_Pos);
@@ -6,18 +6,27 @@
 
 #include "stm32f10x.h"
 #include "system_clock.h"
+#include "system_cycles.h"
 #include "system_interrupts.h"
+#include "system_load.h"
 #include "status_led.h"
 #include "device_config.h"
 #include "usb.h"
 
 int main() {
     system_clock_init();
+    system_cycles_init();
     system_interrupts_init();
     device_config_init();
     status_led_init();
     usb_init();
+    system_load_init();
     while (1) {
-        usb_poll();
+        uint32_t poll_start = system_cycles_get();
+        int busy = usb_poll();
+        system_load_account(busy, poll_start);
+        if (!busy) {
+            usb_wait_for_events();
+        }
     }
 }
@@ -0,0 +1,105 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef RING_BUF_H
+#define RING_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Single-producer/single-consumer byte ring.
+ *
+ * head and tail are free-running indices: the producer only advances head,
+ * the consumer only advances tail, and either side may run in an interrupt
+ * handler. The byte count is head - tail, so the whole buffer is usable.
+ * size must be a power of two.
+ *
+ * A producer writes the data first and then publishes it with
+ * ring_buf_commit_write, a consumer reads the data first and then frees the
+ * space with ring_buf_commit_read. Both insert a memory barrier before moving
+ * the index, so the other side never sees an index ahead of the data.
+ *
+ * ring_buf_peek_read and ring_buf_peek_write return the data in place as
+ * contiguous spans, so callers copy whole spans with memcpy, DMA or the
+ * packet buffer routines. Data wrapping around the end of the buffer is
+ * returned as two spans, the second one is peeked at the offset of the
+ * first span's size.
+ *
+ * A producer that cannot be held back, like circular RX DMA, may overwrite
+ * unread data. The count then exceeds size and only the last size bytes are
+ * valid, the consumer must skip the rest with ring_buf_commit_read before
+ * peeking. ring_buf_space returns 0 in that state.
+ */
+
+typedef struct {
+    volatile uint32_t   head;
+    volatile uint32_t   tail;
+    uint32_t            size;
+    uint8_t             *data;
+} ring_buf_t;
+
+static inline void ring_buf_init(ring_buf_t *buf, uint8_t *data, uint32_t size) {
+    buf->head = 0;
+    buf->tail = 0;
+    buf->size = size;
+    buf->data = data;
+}
+
+/* Discards the contents, both indices are set to pos, must not race with the producer or consumer */
+static inline void ring_buf_reset(ring_buf_t *buf, uint32_t pos) {
+    buf->head = pos;
+    buf->tail = pos;
+}
+
+/* Returns number of bytes in buffer, more than size after the producer has overwritten unread data */
+static inline size_t ring_buf_count(const ring_buf_t *buf) {
+    return buf->head - buf->tail;
+}
+
+/* Returns available buffer space in bytes */
+static inline size_t ring_buf_space(const ring_buf_t *buf) {
+    size_t count = ring_buf_count(buf);
+    return (count < buf->size) ? buf->size - count : 0;
+}
+
+/*
+ * Returns the contiguous span of readable bytes starting offset bytes past
+ * the tail, *count is set to the span size. offset must not exceed the byte count.
+ */
+static inline uint8_t *ring_buf_peek_read(const ring_buf_t *buf, size_t offset, size_t *count) {
+    size_t pos = (buf->tail + offset) & (buf->size - 1);
+    size_t available = ring_buf_count(buf) - offset;
+    size_t end = buf->size - pos;
+    *count = available < end ? available : end;
+    return &buf->data[pos];
+}
+
+/*
+ * Returns the contiguous span of writable space starting offset bytes past
+ * the head, *space is set to the span size. offset must not exceed the free space.
+ */
+static inline uint8_t *ring_buf_peek_write(const ring_buf_t *buf, size_t offset, size_t *space) {
+    size_t pos = (buf->head + offset) & (buf->size - 1);
+    size_t available = ring_buf_space(buf) - offset;
+    size_t end = buf->size - pos;
+    *space = available < end ? available : end;
+    return &buf->data[pos];
+}
+
+/* Publishes count bytes written at the head, producer only */
+static inline void ring_buf_commit_write(ring_buf_t *buf, size_t count) {
+    __sync_synchronize();
+    buf->head += count;
+}
+
+/* Frees count bytes read at the tail, consumer only */
+static inline void ring_buf_commit_read(ring_buf_t *buf, size_t count) {
+    __sync_synchronize();
+    buf->tail += count;
+}
+
+#endif /* RING_BUF_H */
@@ -0,0 +1,25 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef SYSTEM_CYCLES_H
+#define SYSTEM_CYCLES_H
+
+#include <stdint.h>
+#include "stm32f10x.h"
+
+void system_cycles_init(void);
+
+/* Free-running core clock cycle counter, wraps every ~59 s at 72 MHz */
+
+__attribute__((always_inline)) inline static uint32_t system_cycles_get(void) {
+    return DWT->CYCCNT;
+}
+
+__attribute__((always_inline)) inline static uint32_t system_cycles_to_us(uint32_t cycles) {
+    return cycles / (SystemCoreClock / 1000000UL);
+}
+
+#endif /* SYSTEM_CYCLES_H */
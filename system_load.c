@@ -0,0 +1,49 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include "stm32f10x.h"
+#include "system_cycles.h"
+#include "system_load.h"
+
+static struct {
+    uint32_t window_start;
+    uint32_t busy_cycles;
+    uint8_t  load;
+    uint8_t  peak;
+} system_load_state;
+
+void system_load_init() {
+    system_load_state.window_start = system_cycles_get();
+}
+
+void system_load_account(int busy, uint32_t iteration_start) {
+    uint32_t now = system_cycles_get();
+    uint32_t window_cycles = now - system_load_state.window_start;
+    if (busy) {
+        system_load_state.busy_cycles += now - iteration_start;
+    }
+    if (window_cycles >= SystemCoreClock) {
+        uint32_t load = system_load_state.busy_cycles / (window_cycles / 100);
+        system_load_state.load = (load > 100) ? 100 : load;
+        if (system_load_state.load > system_load_state.peak) {
+            system_load_state.peak = system_load_state.load;
+        }
+        system_load_state.window_start = now;
+        system_load_state.busy_cycles = 0;
+    }
+}
+
+uint8_t system_load_get() {
+    return system_load_state.load;
+}
+
+uint8_t system_load_get_peak() {
+    return system_load_state.peak;
+}
+
+void system_load_reset_peak() {
+    system_load_state.peak = system_load_state.load;
+}
@@ -0,0 +1,25 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef SYSTEM_LOAD_H
+#define SYSTEM_LOAD_H
+
+#include <stdint.h>
+
+/*
+ * Main loop CPU utilization. A poll iteration that handled a USB event
+ * or moved port data is busy, any other iteration is idle. Time spent
+ * in interrupt handlers is accounted to the iteration they preempted.
+ */
+
+void system_load_init(void);
+void system_load_account(int busy, uint32_t iteration_start);
+
+uint8_t system_load_get(void);      /* percent, over the last second */
+uint8_t system_load_get_peak(void); /* percent, since startup or the last reset */
+void system_load_reset_peak(void);
+
+#endif /* SYSTEM_LOAD_H */
@@ -0,0 +1,71 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include <string.h>
+#include "stm32f10x.h"
+#include "system_ramfunc.h"
+#include "system_profile.h"
+
+#if defined(SYSTEM_PROFILE)
+
+static system_profile_counter_t system_profile_counters[system_profile_point_last];
+
+static const char *system_profile_names[system_profile_point_last] = {
+    [system_profile_point_usb_ctr]          = "usb ctr",
+    [system_profile_point_usb_sof]          = "usb sof",
+    [system_profile_point_cdc_frame]        = "cdc frame",
+    [system_profile_point_cdc_poll_port1]   = "cdc poll 1",
+    [system_profile_point_cdc_poll_port2]   = "cdc poll 2",
+    [system_profile_point_cdc_poll_port3]   = "cdc poll 3",
+    [system_profile_point_dma_tx_port1]     = "dma tx 1",
+    [system_profile_point_dma_tx_port2]     = "dma tx 2",
+    [system_profile_point_dma_tx_port3]     = "dma tx 3",
+    [system_profile_point_usart_port1]      = "usart 1",
+    [system_profile_point_usart_port2]      = "usart 2",
+    [system_profile_point_usart_port3]      = "usart 3",
+    [system_profile_point_dma_rx_port1]     = "dma rx 1",
+    [system_profile_point_dma_rx_port2]     = "dma rx 2",
+    [system_profile_point_dma_rx_port3]     = "dma rx 3",
+    [system_profile_point_usb_dma_copy]     = "dma copy",
+    [system_profile_point_usb_pb_read]      = "pma read/64B",
+    [system_profile_point_usb_pb_write]     = "pma write/64B",
+};
+
+/*
+ * Some points are recorded from more than one execution context, for example
+ * pma read/64B from the main loop, the USB interrupt and the USART TX DMA
+ * interrupt handlers, so interrupts are disabled while a counter is updated.
+ * A reset racing with an update can only leave one stale sample behind.
+ */
+
+RAMFUNC void system_profile_record(system_profile_point_t point, uint32_t cycles) {
+    system_profile_counter_t *counter = &system_profile_counters[point];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if ((counter->calls == 0) || (cycles < counter->min_cycles)) {
+        counter->min_cycles = cycles;
+    }
+    if (cycles > counter->max_cycles) {
+        counter->max_cycles = cycles;
+    }
+    counter->total_cycles += cycles;
+    counter->calls++;
+    __set_PRIMASK(primask);
+}
+
+const system_profile_counter_t *system_profile_get(system_profile_point_t point) {
+    return &system_profile_counters[point];
+}
+
+const char *system_profile_get_name(system_profile_point_t point) {
+    return system_profile_names[point];
+}
+
+void system_profile_reset() {
+    memset(system_profile_counters, 0, sizeof(system_profile_counters));
+}
+
+#endif /* SYSTEM_PROFILE */
@@ -0,0 +1,67 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef SYSTEM_PROFILE_H
+#define SYSTEM_PROFILE_H
+
+#include <stdint.h>
+#include "system_cycles.h"
+
+/*
+ * Cycle-accurate profiling of the hot handlers, built with "make PROFILE=1".
+ * Without SYSTEM_PROFILE defined the macros below compile to nothing.
+ */
+
+typedef enum {
+    system_profile_point_usb_ctr,
+    system_profile_point_usb_sof,
+    system_profile_point_cdc_frame,
+    system_profile_point_cdc_poll_port1,
+    system_profile_point_cdc_poll_port2,
+    system_profile_point_cdc_poll_port3,
+    system_profile_point_dma_tx_port1,
+    system_profile_point_dma_tx_port2,
+    system_profile_point_dma_tx_port3,
+    system_profile_point_usart_port1,
+    system_profile_point_usart_port2,
+    system_profile_point_usart_port3,
+    system_profile_point_dma_rx_port1,
+    system_profile_point_dma_rx_port2,
+    system_profile_point_dma_rx_port3,
+    system_profile_point_usb_dma_copy,  /* completed copies only */
+    system_profile_point_usb_pb_read,   /* cycles per 64 bytes */
+    system_profile_point_usb_pb_write,  /* cycles per 64 bytes */
+    system_profile_point_last,
+} system_profile_point_t;
+
+typedef struct {
+    uint32_t    calls;
+    uint32_t    min_cycles;
+    uint32_t    max_cycles;
+    uint64_t    total_cycles;
+} system_profile_counter_t;
+
+#if defined(SYSTEM_PROFILE)
+
+void system_profile_record(system_profile_point_t point, uint32_t cycles);
+const system_profile_counter_t *system_profile_get(system_profile_point_t point);
+const char *system_profile_get_name(system_profile_point_t point);
+void system_profile_reset(void);
+
+#define SYSTEM_PROFILE_START(name)          uint32_t name = system_cycles_get()
+#define SYSTEM_PROFILE_STOP(name, point)    system_profile_record((point), system_cycles_get() - (name))
+#define SYSTEM_PROFILE_STOP_PER(name, point, units, per_units) \
+    system_profile_record((point), (system_cycles_get() - (name)) * (per_units) / (units))
+
+#else
+
+#define SYSTEM_PROFILE_START(name)
+#define SYSTEM_PROFILE_STOP(name, point)
+#define SYSTEM_PROFILE_STOP_PER(name, point, units, per_units)
+
+#endif /* SYSTEM_PROFILE */
+
+#endif /* SYSTEM_PROFILE_H */
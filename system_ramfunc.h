@@ -0,0 +1,31 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef SYSTEM_RAMFUNC_H
+#define SYSTEM_RAMFUNC_H
+
+/*
+ * Functions marked RAMFUNC run from SRAM instead of flash, which needs two
+ * wait states at 72 MHz. They are linked into the .RamFunc section that the
+ * STM32Cube linker script places in .data, so the startup code copies them
+ * to SRAM along with initialized variables. The linker adds long branch
+ * veneers for calls between flash and SRAM, and the flash callee still pays
+ * the wait states, so functions called from RAMFUNC interrupt handlers are
+ * RAMFUNC too. Only the configuration mode shell path stays in flash.
+ * RAMFUNC code takes SRAM from the CDC buffer arena, ram_check.ld fails
+ * the link when it leaves too little headroom.
+ *
+ * Build with "make NO_RAMFUNC=1" to keep all code in flash, for example to
+ * compare "perf" profiles. Other toolchains keep RAMFUNC code in flash.
+ */
+
+#if defined(__GNUC__) && !defined(__CC_ARM) && !defined(SYSTEM_NO_RAMFUNC)
+#define RAMFUNC __attribute__ ((section(".RamFunc"), noinline))
+#else
+#define RAMFUNC
+#endif
+
+#endif /* SYSTEM_RAMFUNC_H */
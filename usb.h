@@ -8,6 +8,10 @@
 #define USB_H
 
 void usb_init(void);
-void usb_poll(void);
+int usb_poll(void);
+/* Sleeps until the next interrupt when USB is interrupt-driven, returns immediately otherwise */
+void usb_wait_for_events(void);
+/* Called from interrupt handlers that leave work for usb_poll, the next usb_wait_for_events returns immediately */
+void usb_wake(void);
 
 #endif /* USB_H */
@@ -7,7 +7,12 @@
 #include <string.h>
 #include "stm32f10x.h"
 #include "system_interrupts.h"
-#include "circ_buf.h"
+#include "system_cycles.h"
+#include "system_profile.h"
+#include "system_ramfunc.h"
+#include "ring_buf.h"
+#include "buf_pool.h"
+#include "usb.h"
 #include "usb_std.h"
 #include "usb_core.h"
 #include "usb_descriptors.h"
@@ -35,12 +40,20 @@ static const usb_cdc_line_coding_t usb_cdc_default_line_coding = {
 };
 
 typedef struct {
-    circ_buf_t              rx_buf;
-    uint8_t                 _rx_data[USB_CDC_BUF_SIZE];
-    circ_buf_t              tx_buf;
-    uint8_t                 _tx_data[USB_CDC_BUF_SIZE];
+    uint32_t                pos;
+    uint32_t                timestamp;
+} usb_cdc_rx_mark_t;
+
+typedef struct {
+    ring_buf_t              rx_buf;     /* produced by UART RX DMA, consumed by the IN endpoint */
+    ring_buf_t              tx_buf;     /* produced by the OUT endpoint, consumed by UART TX DMA */
+    size_t                  rx_buf_min_size;
+    uint32_t                rx_level_peak;  /* since the last RX buffer resize or shrink check */
+    volatile uint8_t        rx_buf_shrink_due;
+    uint32_t                rx_dma_wraps;   /* RX DMA buffer wraps since the channel was started */
     usb_cdc_line_coding_t   line_coding;
-    uint8_t                 usb_rx_pending_ep;
+    volatile uint8_t        usb_rx_pending_ep;
+    uint8_t                 rts_throttled;
     size_t                  last_dma_tx_size;
     uint8_t                 rx_zlp_pending;
     uint8_t                 line_state_change_pending;
@@ -51,10 +64,56 @@ typedef struct {
     uint8_t                 dtr_active;
     uint8_t                 txa_active;
     volatile uint32_t       *txa_bitband_clear;
+    uint32_t                rx_bytes_in;
+    uint32_t                rx_bytes_out;
+    usb_cdc_rx_mark_t       rx_marks[USB_CDC_RX_LATENCY_MARKS];
+    uint8_t                 rx_marks_first;
+    uint8_t                 rx_marks_count;
 } usb_cdc_state_t;
 
 static usb_cdc_state_t usb_cdc_states[USB_CDC_NUM_PORTS];
 
+/*
+ * Port Buffer Arena, RX and TX buffers of all ports are allocated from
+ * its block pool on USB reset. Buffer sizes are powers of 2 not smaller
+ * than a block, so every buffer stays half-word aligned for DMA.
+ *
+ * Configured sizes are the minimum, pool memory left over is shared:
+ * an RX buffer that fills up to the grow level doubles the next time
+ * it drains, and halves back when its level stays low for a shrink interval.
+ */
+
+static uint8_t usb_cdc_buf_arena[USB_CDC_BUF_ARENA_SIZE] __attribute__ ((aligned(4)));
+static buf_pool_t usb_cdc_buf_pool;
+
+/*
+ * SRAM budget (20 KiB), estimated from the object sizes of this tree:
+ * ~1.1 KiB .data (mostly the USB trace ring), ~2.3 KiB .bss besides
+ * the arena, up to ~5.5 KiB of .RamFunc code copied into .data,
+ * ~0.5 KiB of libc state and the 1.5 KiB minimum heap and stack of
+ * the linker script. That leaves ~9.2 KiB for the arena, the 8 KiB
+ * arena keeps ~1.2 KiB of headroom. ram_check.ld fails the link when
+ * the headroom drops below 1 KiB.
+ */
+
+typedef char usb_cdc_buf_arena_size_check[(USB_CDC_BUF_ARENA_SIZE <= BUF_POOL_MAX_BLOCKS * BUF_POOL_BLOCK_SIZE) ? 1 : -1];
+
+static const cdc_port_t usb_cdc_default_buf_config = {
+    .rx_buf_size = USB_CDC_BUF_SIZE,
+    .tx_buf_size = USB_CDC_BUF_SIZE,
+};
+
+/* USB CDC Port Statistics, not cleared on USB reset */
+
+typedef struct {
+    usb_cdc_port_stats_t    stats;
+    uint32_t                rx_bytes_prev;
+    uint32_t                tx_bytes_prev;
+} usb_cdc_port_counters_t;
+
+static usb_cdc_port_counters_t usb_cdc_port_counters[USB_CDC_NUM_PORTS];
+static usb_cdc_rx_latency_t usb_cdc_port_rx_latency[USB_CDC_NUM_PORTS];
+
 /* Helper Functions */
 
 static USART_TypeDef* const usb_cdc_port_usarts[] = {
@@ -87,22 +146,36 @@ static DMA_Channel_TypeDef* usb_cdc_get_port_dma_channel(int port, usb_cdc_port_
     return (DMA_Channel_TypeDef*)0; 
 }
 
-static uint8_t const usb_cdc_port_data_endpoints[] = {
+static uint8_t const usb_cdc_port_data_in_endpoints[] = {
     usb_endpoint_address_cdc_0_data,
     usb_endpoint_address_cdc_1_data,
     usb_endpoint_address_cdc_2_data,
 };
 
-static uint8_t usb_cdc_get_port_data_ep(int port) {
-    if (port < (sizeof(usb_cdc_port_data_endpoints) / sizeof(*usb_cdc_port_data_endpoints))) {
-        return usb_cdc_port_data_endpoints[port];
+static uint8_t const usb_cdc_port_data_out_endpoints[] = {
+    usb_endpoint_address_cdc_0_data_out,
+    usb_endpoint_address_cdc_1_data,
+    usb_endpoint_address_cdc_2_data,
+};
+
+static uint8_t usb_cdc_get_port_data_in_ep(int port) {
+    if (port < (sizeof(usb_cdc_port_data_in_endpoints) / sizeof(*usb_cdc_port_data_in_endpoints))) {
+        return usb_cdc_port_data_in_endpoints[port];
+    }
+    return -1;
+}
+
+static uint8_t usb_cdc_get_port_data_out_ep(int port) {
+    if (port < (sizeof(usb_cdc_port_data_out_endpoints) / sizeof(*usb_cdc_port_data_out_endpoints))) {
+        return usb_cdc_port_data_out_endpoints[port];
     }
     return -1;
 }
 
 static int usb_cdc_data_endpoint_port(uint8_t ep_num) {
-    for (int port = 0; port < (sizeof(usb_cdc_port_data_endpoints) / sizeof(*usb_cdc_port_data_endpoints)); port++) {
-        if (usb_cdc_port_data_endpoints[port] == ep_num) {
+    for (int port = 0; port < (sizeof(usb_cdc_port_data_in_endpoints) / sizeof(*usb_cdc_port_data_in_endpoints)); port++) {
+        if ((usb_cdc_port_data_in_endpoints[port] == ep_num) ||
+            (usb_cdc_port_data_out_endpoints[port] == ep_num)) {
             return port;
         }
     }
@@ -177,7 +250,7 @@ static void usb_cdc_notify_port_state_change(int port) {
     usb_cdc_serial_state_t state = usb_cdc_states[port].serial_state;
     if (state != usb_cdc_states[port].serial_state_prev) {
         if (usb_cdc_send_port_state(port, state) != -1) {
-            usb_cdc_serial_state_t mask = (state & (USB_CDC_SERIAL_STATE_OVERRUN | USB_CDC_SERIAL_STATE_PARITY_ERROR));
+            usb_cdc_serial_state_t mask = (state & (USB_CDC_SERIAL_STATE_OVERRUN | USB_CDC_SERIAL_STATE_PARITY_ERROR | USB_CDC_SERIAL_STATE_FRAMING_ERROR));
             usb_cdc_serial_state_t _state;
             do {
                 _state = usb_cdc_states[port].serial_state;
@@ -212,13 +285,23 @@ static void usb_cdc_set_port_dtr(int port, int dtr_active) {
     }
 }
 
-static void usb_cdc_update_port_rts(int port) {
+/* Called from the main loop and from RX DMA and USART interrupt handlers */
+RAMFUNC static void usb_cdc_update_port_rts(int port) {
     if ((port < USB_CDC_NUM_PORTS)) {
         const gpio_pin_t *rts_pin = &device_config_get()->cdc_config.port_config[port].pins[cdc_pin_rts];
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-        circ_buf_t *rx_buf = &cdc_state->rx_buf;
-        int rts_active = ((circ_buf_space(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE) > (USB_CDC_BUF_SIZE>>1))) && cdc_state->rts_active;
+        ring_buf_t *rx_buf = &cdc_state->rx_buf;
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        int rx_buf_half_full = (ring_buf_count(rx_buf) >= (rx_buf->size>>1));
+        int rts_active = !rx_buf_half_full && cdc_state->rts_active;
+        int rts_throttled = rx_buf_half_full && cdc_state->rts_active;
+        if (rts_throttled && !cdc_state->rts_throttled) {
+            usb_cdc_port_counters[port].stats.rts_throttled++;
+        }
+        cdc_state->rts_throttled = rts_throttled;
         gpio_pin_set(rts_pin, rts_active);
+        __set_PRIMASK(primask);
     }
 }
 
@@ -319,56 +402,308 @@ static usb_status_t usb_cdc_set_line_coding(int port, const usb_cdc_line_coding_
     return usb_status_ack;
 }
 
+/* RX Latency Tracking */
+
+/*
+ * Each batch of bytes found in rx_buf by usb_cdc_sync_rx_buffer gets a mark
+ * holding the free-running rx_buf position of its last byte and the time it
+ * was seen. A mark is retired with one latency sample once all its bytes
+ * are committed to the IN endpoint. If the mark queue is full, the newest
+ * mark absorbs the batch, which can only overestimate the latency.
+ *
+ * Marks are added and restarted by usb_cdc_sync_rx_buffer with interrupts
+ * disabled, usb_cdc_rx_latency_commit disables them while it retires marks.
+ */
+
+static void usb_cdc_rx_latency_restart(usb_cdc_state_t *cdc_state, size_t rx_bytes_available) {
+    cdc_state->rx_bytes_in = cdc_state->rx_bytes_out + rx_bytes_available;
+    cdc_state->rx_marks_count = 0;
+}
+
+static void usb_cdc_rx_latency_mark(usb_cdc_state_t *cdc_state, size_t rx_bytes_received) {
+    cdc_state->rx_bytes_in += rx_bytes_received;
+    if (cdc_state->rx_marks_count < USB_CDC_RX_LATENCY_MARKS) {
+        uint8_t mark_index = (cdc_state->rx_marks_first + cdc_state->rx_marks_count) % USB_CDC_RX_LATENCY_MARKS;
+        cdc_state->rx_marks[mark_index].timestamp = system_cycles_get();
+        cdc_state->rx_marks_count++;
+    }
+    if (cdc_state->rx_marks_count) {
+        uint8_t last_index = (cdc_state->rx_marks_first + cdc_state->rx_marks_count - 1) % USB_CDC_RX_LATENCY_MARKS;
+        cdc_state->rx_marks[last_index].pos = cdc_state->rx_bytes_in;
+    }
+}
+
+static void usb_cdc_rx_latency_commit(int port, size_t rx_bytes_sent) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    usb_cdc_rx_latency_t *rx_latency = &usb_cdc_port_rx_latency[port];
+    uint32_t now = system_cycles_get();
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    cdc_state->rx_bytes_out += rx_bytes_sent;
+    while (cdc_state->rx_marks_count) {
+        usb_cdc_rx_mark_t *mark = &cdc_state->rx_marks[cdc_state->rx_marks_first];
+        uint32_t latency_us;
+        int bucket = 0;
+        if ((int32_t)(cdc_state->rx_bytes_out - mark->pos) < 0) {
+            break;
+        }
+        latency_us = system_cycles_to_us(now - mark->timestamp);
+        if (latency_us > 1) {
+            bucket = 31 - __CLZ(latency_us);
+            if (bucket >= USB_CDC_RX_LATENCY_BUCKETS) {
+                bucket = USB_CDC_RX_LATENCY_BUCKETS - 1;
+            }
+        }
+        rx_latency->buckets[bucket]++;
+        if (latency_us > rx_latency->max_us) {
+            rx_latency->max_us = latency_us;
+        }
+        cdc_state->rx_marks_first = (cdc_state->rx_marks_first + 1) % USB_CDC_RX_LATENCY_MARKS;
+        cdc_state->rx_marks_count--;
+    }
+    __set_PRIMASK(primask);
+}
+
 /* USB USART RX Functions */
 
-static void usb_cdc_port_send_rx_usb(int port) {
+static int usb_cdc_port_send_rx_usb(int port) {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
-    uint8_t rx_ep = usb_cdc_get_port_data_ep(port);
-    size_t rx_bytes_available = circ_buf_count(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
+    uint8_t rx_ep = usb_cdc_get_port_data_in_ep(port);
+    size_t rx_bytes_available = ring_buf_count(rx_buf);
     size_t ep_space_available = usb_space_available(rx_ep);
     if (ep_space_available) {
+        if (rx_bytes_available > rx_buf->size) {
+            /* RX DMA has overwritten the oldest bytes, skip to the oldest byte still in rx_buf */
+            ring_buf_commit_read(rx_buf, rx_bytes_available - rx_buf->size);
+            rx_bytes_available = rx_buf->size;
+        }
         if (rx_bytes_available) {
             if (cdc_state->line_coding.bDataBits == usb_cdc_data_bits_7) {
                 size_t bytes_count = ep_space_available < rx_bytes_available ? ep_space_available : rx_bytes_available;
-                uint8_t *buf_ptr = &rx_buf->data[rx_buf->tail];
-                while (bytes_count--) {
-                    *(buf_ptr++) &= 0x7f;
+                size_t offset = 0;
+                while (offset < bytes_count) {
+                    size_t span_size;
+                    uint8_t *span = ring_buf_peek_read(rx_buf, offset, &span_size);
+                    if (span_size > bytes_count - offset) {
+                        span_size = bytes_count - offset;
+                    }
+                    for (size_t i = 0; i < span_size; i++) {
+                        span[i] &= 0x7f;
+                    }
+                    offset += span_size;
                 }
             }
-            cdc_state->rx_zlp_pending = (usb_circ_buf_send(rx_ep, rx_buf, USB_CDC_BUF_SIZE) == ep_space_available);
+            size_t bytes_sent;
+            if ((port == USB_CDC_CONFIG_PORT) && usb_cdc_config_mode) {
+                /* Shell output may drop unsent data, copy synchronously */
+                bytes_sent = usb_ring_buf_send(rx_ep, rx_buf);
+            } else {
+                bytes_sent = usb_ring_buf_send_dma(rx_ep, rx_buf);
+            }
+            cdc_state->rx_zlp_pending = (bytes_sent == ep_space_available);
+            usb_cdc_port_counters[port].stats.rx_bytes += bytes_sent;
+            usb_cdc_rx_latency_commit(port, bytes_sent);
             usb_cdc_update_port_rts(port);
+            return 1;
         } else {
             if (cdc_state->rx_zlp_pending) {
                 cdc_state->rx_zlp_pending = 0;
                 usb_send(rx_ep, 0, 0);
+                usb_cdc_port_counters[port].stats.rx_zlps++;
+                return 1;
             }
         }
     }
+    return 0;
+}
+
+/*
+ * RX DMA runs in circular mode with half-transfer and transfer-complete
+ * interrupts. Each transfer-complete flag is one buffer wrap, so the
+ * free-running DMA position is rx_dma_wraps * size + (size - CNDTR) and
+ * rx_buf head always follows it exactly, even after an overrun. Whoever
+ * sees the flag first counts the wrap, interrupts are disabled meanwhile
+ * so it is counted once.
+ */
+
+static uint32_t usb_cdc_get_port_rx_dma_tcif(int port) {
+    static const uint32_t port_rx_dma_tcifs[] = { DMA_ISR_TCIF5, DMA_ISR_TCIF6, DMA_ISR_TCIF3 };
+    return port_rx_dma_tcifs[port];
+}
+
+RAMFUNC static uint32_t usb_cdc_port_rx_dma_head(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    uint32_t tcif = usb_cdc_get_port_rx_dma_tcif(port);
+    uint32_t primask = __get_PRIMASK();
+    uint32_t dma_rx_count;
+    __disable_irq();
+    dma_rx_count = dma_rx_ch->CNDTR;
+    if (DMA1->ISR & tcif) {
+        DMA1->IFCR = tcif;
+        cdc_state->rx_dma_wraps++;
+        /* CNDTR may have been read before the wrap */
+        dma_rx_count = dma_rx_ch->CNDTR;
+    }
+    __set_PRIMASK(primask);
+    return cdc_state->rx_dma_wraps * cdc_state->rx_buf.size + (cdc_state->rx_buf.size - dma_rx_count);
 }
 
+/*
+ * RX DMA and USART interrupt handlers sync rx_buf, so interrupts are disabled
+ * while the channel restarts. No USB copy may be sending from rx_buf.
+ */
 static void usb_cdc_port_start_rx(int port) {
     DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
     dma_rx_ch->CCR &= ~(DMA_CCR_EN);
-    dma_rx_ch->CMAR = (uint32_t)&rx_buf->data;
-    dma_rx_ch->CNDTR = USB_CDC_BUF_SIZE;
+    DMA1->IFCR = usb_cdc_get_port_rx_dma_tcif(port);
+    cdc_state->rx_dma_wraps = 0;
+    ring_buf_reset(rx_buf, 0);
+    dma_rx_ch->CMAR = (uint32_t)rx_buf->data;
+    dma_rx_ch->CNDTR = rx_buf->size;
     dma_rx_ch->CCR |= DMA_CCR_EN;
+    __set_PRIMASK(primask);
 }
 
-static void usb_cdc_sync_rx_buffer(int port) {
-    circ_buf_t *rx_buf = &usb_cdc_states[port].rx_buf;
-    int rx_buf_tail = rx_buf->tail;
-    size_t current_rx_bytes_available = circ_buf_count(rx_buf->head, rx_buf_tail, USB_CDC_BUF_SIZE);
-    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
-    size_t dma_head = USB_CDC_BUF_SIZE - dma_rx_ch->CNDTR;
-    size_t dma_rx_bytes_available = circ_buf_count(dma_head, rx_buf_tail, USB_CDC_BUF_SIZE);
+/*
+ * Publishes bytes written by RX DMA. Called from the main loop and from
+ * interrupt handlers, so interrupts are disabled while rx_buf head, the
+ * latency marks, RTS and the level peaks are updated.
+ */
+RAMFUNC static void usb_cdc_sync_rx_buffer(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    size_t current_rx_bytes_available = ring_buf_count(rx_buf);
+    uint32_t dma_head = usb_cdc_port_rx_dma_head(port);
+    size_t dma_rx_bytes_received = dma_head - rx_buf->head;
+    size_t dma_rx_bytes_available = current_rx_bytes_available + dma_rx_bytes_received;
+    if (dma_rx_bytes_available > rx_buf->size) {
+        /*
+         * DMA has overwritten data not sent yet, the buffer holds the last
+         * size bytes. The IN endpoint skips the overwritten ones. rx_buf may
+         * still be past size from an earlier overrun the IN endpoint has not
+         * skipped yet, only the bytes received since then are lost now.
+         */
+        size_t prev_rx_level = (current_rx_bytes_available > rx_buf->size) ?
+                               current_rx_bytes_available : rx_buf->size;
+        if (current_rx_bytes_available <= rx_buf->size) {
+            usb_cdc_notify_port_overrun(port);
+            usb_cdc_port_counters[port].stats.rx_overruns++;
+        }
+        usb_cdc_port_counters[port].stats.rx_overrun_bytes += dma_rx_bytes_available - prev_rx_level;
+        dma_rx_bytes_available = rx_buf->size;
+        usb_cdc_rx_latency_restart(cdc_state, dma_rx_bytes_available);
+    } else if (dma_rx_bytes_received) {
+        usb_cdc_rx_latency_mark(cdc_state, dma_rx_bytes_received);
+    }
+    ring_buf_commit_write(rx_buf, dma_rx_bytes_received);
     usb_cdc_update_port_rts(port);
-    if (dma_rx_bytes_available < current_rx_bytes_available) {
-        usb_cdc_notify_port_overrun(port);
+    if (dma_rx_bytes_available > usb_cdc_port_counters[port].stats.rx_buf_peak) {
+        usb_cdc_port_counters[port].stats.rx_buf_peak = dma_rx_bytes_available;
+    }
+    if (dma_rx_bytes_available > cdc_state->rx_level_peak) {
+        cdc_state->rx_level_peak = dma_rx_bytes_available;
+    }
+    __set_PRIMASK(primask);
+}
+
+RAMFUNC static void usb_cdc_port_rx_dma_event(int port) {
+    if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
+        usb_cdc_sync_rx_buffer(port);
+        /* Make the main loop send the data without waiting for another event */
+        usb_wake();
+    } else {
+        usb_cdc_port_rx_dma_head(port);
+    }
+}
+
+/* Elastic RX Buffers */
+
+#define USB_CDC_RX_BUF_GROW_LEVEL(size)     ((size) - ((size) >> 2))
+#define USB_CDC_RX_BUF_SHRINK_LEVEL(size)   ((size) >> 2)
+
+/*
+ * Moves the RX DMA to a new buffer of new_size bytes. Only an empty buffer
+ * is moved, so no IN transfer can be copying from it. Interrupts are disabled
+ * while the channel is stopped, bytes received meanwhile wait in the USART
+ * and bytes that arrived since the last sync are carried over.
+ */
+static int usb_cdc_port_move_rx_buf(int port, uint8_t *data, size_t new_size) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
+    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
+    size_t count, offset = 0;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    usb_cdc_sync_rx_buffer(port);
+    if (ring_buf_count(rx_buf) || ((port == USB_CDC_CONFIG_PORT) && usb_cdc_config_mode)) {
+        __set_PRIMASK(primask);
+        return 0;
+    }
+    dma_rx_ch->CCR &= ~(DMA_CCR_EN);
+    usb_cdc_sync_rx_buffer(port);
+    count = ring_buf_count(rx_buf);
+    while (offset < count) {
+        size_t span_size;
+        uint8_t *span = ring_buf_peek_read(rx_buf, offset, &span_size);
+        memmove(&data[new_size - count + offset], span, span_size);
+        offset += span_size;
+    }
+    ring_buf_init(rx_buf, data, new_size);
+    usb_cdc_port_start_rx(port);
+    /* DMA starts at data[0], carried over bytes end right before it */
+    rx_buf->tail = 0 - count;
+    cdc_state->rx_level_peak = count;
+    __set_PRIMASK(primask);
+    return 1;
+}
+
+/* rx_level_peak is raised by usb_cdc_sync_rx_buffer from interrupt handlers */
+static void usb_cdc_port_reset_rx_level_peak(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    cdc_state->rx_level_peak = ring_buf_count(&cdc_state->rx_buf);
+    __set_PRIMASK(primask);
+}
+
+static void usb_cdc_port_resize_rx_buf(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
+    size_t size = rx_buf->size;
+    if (ring_buf_count(rx_buf)) {
+        return;
+    }
+    if ((cdc_state->rx_level_peak >= USB_CDC_RX_BUF_GROW_LEVEL(size)) && (size < USB_CDC_RX_BUF_SIZE_MAX)) {
+        uint8_t *old_data = rx_buf->data;
+        uint8_t *data = buf_pool_alloc(&usb_cdc_buf_pool, size << 1);
+        if (data == 0) {
+            usb_cdc_port_counters[port].stats.rx_buf_grow_failures++;
+            usb_cdc_port_reset_rx_level_peak(port);
+        } else if (usb_cdc_port_move_rx_buf(port, data, size << 1)) {
+            buf_pool_free(&usb_cdc_buf_pool, old_data, size);
+            usb_cdc_port_counters[port].stats.rx_buf_grows++;
+        } else {
+            buf_pool_free(&usb_cdc_buf_pool, data, size << 1);
+        }
+    } else if (cdc_state->rx_buf_shrink_due) {
+        cdc_state->rx_buf_shrink_due = 0;
+        if ((cdc_state->rx_level_peak <= USB_CDC_RX_BUF_SHRINK_LEVEL(size)) && (size > cdc_state->rx_buf_min_size)) {
+            /* The lower half stays in place, the upper half returns to the pool */
+            if (usb_cdc_port_move_rx_buf(port, rx_buf->data, size >> 1)) {
+                buf_pool_free(&usb_cdc_buf_pool, rx_buf->data + (size >> 1), size >> 1);
+                usb_cdc_port_counters[port].stats.rx_buf_shrinks++;
+            }
+        }
+        usb_cdc_port_reset_rx_level_peak(port);
     }
-    rx_buf->head = dma_head;
 }
 
 /* Configuration Mode Handling */
@@ -377,8 +712,10 @@ void usb_cdc_config_mode_enter() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
     USART_TypeDef *usart = usb_cdc_get_port_usart(USB_CDC_CONFIG_PORT);
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(USB_CDC_CONFIG_PORT, usb_cdc_port_direction_tx);
-    cdc_state->rx_buf.tail = cdc_state->rx_buf.head = 0;
-    cdc_state->tx_buf.tail = cdc_state->tx_buf.head = 0;
+    usb_ring_buf_dma_wait();
+    ring_buf_reset(&cdc_state->rx_buf, 0);
+    ring_buf_reset(&cdc_state->tx_buf, 0);
+    usb_cdc_rx_latency_restart(cdc_state, 0);
     usart->CR1 &= ~(USART_CR1_RE);
     dma_tx_ch->CCR &= ~(DMA_CCR_EN);
     cdc_shell_init();
@@ -387,11 +724,12 @@ void usb_cdc_config_mode_enter() {
 
 void usb_cdc_config_mode_leave() {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(USB_CDC_CONFIG_PORT, usb_cdc_port_direction_rx);
-    size_t dma_head = USB_CDC_BUF_SIZE - dma_rx_ch->CNDTR;
+    uint32_t dma_head = usb_cdc_port_rx_dma_head(USB_CDC_CONFIG_PORT);
     USART_TypeDef *usart = usb_cdc_get_port_usart(USB_CDC_CONFIG_PORT);
-    cdc_state->rx_buf.tail = cdc_state->rx_buf.head = dma_head;
-    cdc_state->tx_buf.tail = cdc_state->tx_buf.head = 0;
+    usb_ring_buf_dma_wait();
+    ring_buf_reset(&cdc_state->rx_buf, dma_head);
+    ring_buf_reset(&cdc_state->tx_buf, 0);
+    usb_cdc_rx_latency_restart(cdc_state, 0);
     usart->CR1 |= USART_CR1_RE;
     usb_cdc_config_mode = 0;
 }
@@ -403,34 +741,40 @@ void usb_cdc_config_mode_leave() {
  */
 
 void usb_cdc_config_mode_process_tx() {
-    uint8_t ep_num = usb_cdc_get_port_data_ep(USB_CDC_CONFIG_PORT);
+    uint8_t ep_num = usb_cdc_get_port_data_out_ep(USB_CDC_CONFIG_PORT);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
+    ring_buf_t *tx_buf = &cdc_state->tx_buf;
     size_t count;
-    if (usb_bytes_available(ep_num) < circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE)) {
-        usb_circ_buf_read(ep_num, tx_buf, USB_CDC_BUF_SIZE);
-    } else {
-        usb_panic();
-    }
-    while((count = circ_buf_count_to_end(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE))) {
-        cdc_shell_process_input(&tx_buf->data[tx_buf->tail], count);
-        tx_buf->tail  = (tx_buf->tail + count) & (USB_CDC_BUF_SIZE - 1);
+    /* A double-buffered endpoint may already hold the next packet after a read */
+    while (usb_bytes_available(ep_num)) {
+        if (usb_bytes_available(ep_num) <= ring_buf_space(tx_buf)) {
+            usb_ring_buf_read(ep_num, tx_buf);
+        } else {
+            usb_panic();
+        }
+        while (ring_buf_count(tx_buf)) {
+            uint8_t *span = ring_buf_peek_read(tx_buf, 0, &count);
+            cdc_shell_process_input(span, count);
+            ring_buf_commit_read(tx_buf, count);
+        }
     }
 }
 
 void cdc_shell_write(const void *buf, size_t count) {
     usb_cdc_state_t *cdc_state = &usb_cdc_states[USB_CDC_CONFIG_PORT];
-    circ_buf_t *rx_buf = &cdc_state->rx_buf;
+    ring_buf_t *rx_buf = &cdc_state->rx_buf;
     while (count) {
         size_t bytes_to_copy;
-        size_t space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
+        size_t space_available;
+        uint8_t *span = ring_buf_peek_write(rx_buf, 0, &space_available);
         if (space_available == 0) {
-            rx_buf->tail = rx_buf->head;
-            space_available = circ_buf_space_to_end(rx_buf->head, rx_buf->tail, USB_CDC_BUF_SIZE);
+            /* Shell output is sent synchronously from this context, unsent output is dropped */
+            ring_buf_commit_read(rx_buf, ring_buf_count(rx_buf));
+            span = ring_buf_peek_write(rx_buf, 0, &space_available);
         }
         bytes_to_copy = (space_available > count) ? count : space_available;
-        memcpy(&rx_buf->data[rx_buf->head], buf, bytes_to_copy);
-        rx_buf->head = (rx_buf->head + bytes_to_copy) & (USB_CDC_BUF_SIZE - 1);
+        memcpy(span, buf, bytes_to_copy);
+        ring_buf_commit_write(rx_buf, bytes_to_copy);
         count -= bytes_to_copy;
         buf = (uint8_t*)buf + bytes_to_copy;
     }
@@ -438,16 +782,23 @@ void cdc_shell_write(const void *buf, size_t count) {
 
 /* USB USART TX Functions */
 
-static void usb_cdc_port_start_tx(int port) {
+/*
+ * Called from the main loop, the USB copy DMA and the USART TX DMA interrupt
+ * handlers. Interrupts are disabled from the busy check until the channel is
+ * started, so only one caller programs it and last_dma_tx_size matches it.
+ */
+RAMFUNC static void usb_cdc_port_start_tx(int port) {
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
-    size_t tx_bytes_available = circ_buf_count_to_end(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
-    int dma_ch_busy = dma_tx_ch->CCR & DMA_CCR_EN;
-    if (!dma_ch_busy) {
+    ring_buf_t *tx_buf = &cdc_state->tx_buf;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!(dma_tx_ch->CCR & DMA_CCR_EN)) {
+        size_t tx_bytes_available;
+        uint8_t *tx_span = ring_buf_peek_read(tx_buf, 0, &tx_bytes_available);
         if (tx_bytes_available) {
             usb_cdc_set_port_txa(port, 1);
-            dma_tx_ch->CMAR = (uint32_t)&tx_buf->data[tx_buf->tail];
+            dma_tx_ch->CMAR = (uint32_t)tx_span;
             dma_tx_ch->CNDTR = tx_bytes_available;
             dma_tx_ch->CCR |= DMA_CCR_EN;
             cdc_state->last_dma_tx_size = tx_bytes_available;
@@ -457,22 +808,61 @@ static void usb_cdc_port_start_tx(int port) {
             usart->CR1 |= USART_CR1_TCIE;
         }
     }
+    __set_PRIMASK(primask);
+}
+
+static void usb_cdc_update_port_tx_buf_peak(int port);
+
+/*
+ * Reads the deferred OUT packet once tx_buf has space for it. Both
+ * usb_cdc_poll and the USART TX DMA interrupt handler resume it,
+ * the packet is claimed by clearing usb_rx_pending_ep atomically.
+ */
+RAMFUNC static int usb_cdc_port_resume_rx(int port) {
+    usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
+    ring_buf_t *tx_buf = &cdc_state->tx_buf;
+    uint8_t rx_ep = cdc_state->usb_rx_pending_ep;
+    if (!rx_ep || cdc_state->line_state_change_pending) {
+        return 0;
+    }
+    /* A DMA copy still owns the packet, the copy complete event resumes it */
+    if (!usb_rx_ready(rx_ep)) {
+        return 0;
+    }
+    if (ring_buf_space(tx_buf) < usb_bytes_available(rx_ep)) {
+        return 0;
+    }
+    if (!__sync_bool_compare_and_swap(&cdc_state->usb_rx_pending_ep, rx_ep, 0)) {
+        return 0;
+    }
+    usb_ring_buf_read_dma(rx_ep, tx_buf);
+    usb_cdc_update_port_tx_buf_peak(port);
+    usb_cdc_port_start_tx(port);
+    /* A double-buffered endpoint may already hold the next packet */
+    if (usb_bytes_available(rx_ep)) {
+        cdc_state->usb_rx_pending_ep = rx_ep;
+        /* Also called from the USART TX DMA interrupt handler, make the main loop resume it */
+        usb_wake();
+    }
+    return 1;
 }
 
-static void usb_cdc_port_tx_complete(int port) {
+RAMFUNC static void usb_cdc_port_tx_complete(int port) {
     DMA_Channel_TypeDef *dma_tx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx);
     usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-    circ_buf_t *tx_buf = &cdc_state->tx_buf;
-    tx_buf->tail = (tx_buf->tail + cdc_state->last_dma_tx_size) & (USB_CDC_BUF_SIZE - 1);
+    ring_buf_t *tx_buf = &cdc_state->tx_buf;
+    ring_buf_commit_read(tx_buf, cdc_state->last_dma_tx_size);
+    usb_cdc_port_counters[port].stats.tx_bytes += cdc_state->last_dma_tx_size;
     dma_tx_ch->CCR &= ~(DMA_CCR_EN);
     if (cdc_state->line_state_change_pending) {
-        size_t tx_bytes_available = circ_buf_count(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
+        size_t tx_bytes_available = ring_buf_count(tx_buf);
         if (tx_bytes_available == 0) {
             cdc_state->line_state_change_ready = 1;
         }
     }
     if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
         usb_cdc_port_start_tx(port);
+        usb_cdc_port_resume_rx(port);
     } else {
         usb_cdc_set_port_txa(port, 0);
         usb_cdc_config_mode_process_tx(port);
@@ -481,25 +871,55 @@ static void usb_cdc_port_tx_complete(int port) {
 
 /* DMA Interrupt Handlers */
 
-void DMA1_Channel4_IRQHandler() {
+RAMFUNC void DMA1_Channel4_IRQHandler() {
     (void)DMA1_Channel4_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF4 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(0);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_tx_port1);
 }
 
-void DMA1_Channel7_IRQHandler() {
+RAMFUNC void DMA1_Channel7_IRQHandler() {
     (void)DMA1_Channel7_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF7 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(1);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_tx_port2);
 }
 
-void DMA1_Channel2_IRQHandler() {
+RAMFUNC void DMA1_Channel2_IRQHandler() {
     (void)DMA1_Channel2_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     uint32_t status = DMA1->ISR & ( DMA_ISR_TCIF2 );
     DMA1->IFCR = status;
     usb_cdc_port_tx_complete(2);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_tx_port3);
+}
+
+RAMFUNC void DMA1_Channel5_IRQHandler() {
+    (void)DMA1_Channel5_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
+    DMA1->IFCR = DMA_IFCR_CHTIF5;
+    usb_cdc_port_rx_dma_event(0);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_rx_port1);
+}
+
+RAMFUNC void DMA1_Channel6_IRQHandler() {
+    (void)DMA1_Channel6_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
+    DMA1->IFCR = DMA_IFCR_CHTIF6;
+    usb_cdc_port_rx_dma_event(1);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_rx_port2);
+}
+
+RAMFUNC void DMA1_Channel3_IRQHandler() {
+    (void)DMA1_Channel3_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
+    DMA1->IFCR = DMA_IFCR_CHTIF3;
+    usb_cdc_port_rx_dma_event(2);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_dma_rx_port3);
 }
 
 /* USART Interrupt Handlers */
@@ -512,28 +932,56 @@ __attribute__((always_inline)) inline static void usb_cdc_usart_irq_handler(int
         *txa_bitband_clear = 1;
         usart->CR1 &= ~(USART_CR1_TCIE);
     }
-    /* Synchronization is not required, no one can interrupt us */
+    /*
+     * USART interrupts have the highest priority, so nothing preempts this
+     * handler. The error counters are only written here, serial_state bits
+     * are set with a plain read-modify-write because every other writer uses
+     * compare-and-swap and retries if this handler ran in between. RX sync
+     * below disables interrupts itself, as it also runs from DMA handlers
+     * and the main loop.
+     */
     if (status & USART_SR_PE) {
         wait_rxne = 1;
         usb_cdc_states[port].serial_state |= USB_CDC_SERIAL_STATE_PARITY_ERROR;
+        usb_cdc_port_counters[port].stats.rx_parity_errors++;
+    }
+    if (status & USART_SR_FE) {
+        usb_cdc_states[port].serial_state |= USB_CDC_SERIAL_STATE_FRAMING_ERROR;
+        usb_cdc_port_counters[port].stats.rx_framing_errors++;
+    }
+    if (status & USART_SR_NE) {
+        usb_cdc_port_counters[port].stats.rx_noise_errors++;
+    }
+    if (status & USART_SR_ORE) {
+        usb_cdc_port_counters[port].stats.rx_usart_overruns++;
+    }
+    if (status & USART_SR_IDLE) {
+        /* The line went idle after a burst, DMA has stored its last byte, pass it on right away */
+        usb_cdc_port_rx_dma_event(port);
     }
     while (wait_rxne && (usart->SR & USART_SR_RXNE));
     (void)usart->DR;
 }
 
-void USART1_IRQHandler() {
+RAMFUNC void USART1_IRQHandler() {
     (void)USART1_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     usb_cdc_usart_irq_handler(0, usb_cdc_port_usarts[0], usb_cdc_states[0].txa_bitband_clear);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usart_port1);
 }
 
-void USART2_IRQHandler() {
+RAMFUNC void USART2_IRQHandler() {
     (void)USART2_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     usb_cdc_usart_irq_handler(1, usb_cdc_port_usarts[1], usb_cdc_states[1].txa_bitband_clear);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usart_port2);
 }
 
-void USART3_IRQHandler() {
+RAMFUNC void USART3_IRQHandler() {
     (void)USART3_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
     usb_cdc_usart_irq_handler(2, usb_cdc_port_usarts[2], usb_cdc_states[2].txa_bitband_clear);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usart_port3);
 }
 
 /* Port Configuration & Control Lines Functions */
@@ -571,6 +1019,47 @@ void usb_cdc_reconfigure() {
     }
 }
 
+/* Port Buffer Configuration */
+
+static int usb_cdc_buf_size_valid(size_t size, size_t min_size) {
+    return (size >= min_size) && ((size & (size - 1)) == 0);
+}
+
+size_t usb_cdc_buf_config_used(const cdc_config_t *cdc_config) {
+    size_t used = 0;
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        used += cdc_config->port_config[port].rx_buf_size;
+        used += cdc_config->port_config[port].tx_buf_size;
+    }
+    return used;
+}
+
+int usb_cdc_buf_config_valid(const cdc_config_t *cdc_config) {
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        const cdc_port_t *port_config = &cdc_config->port_config[port];
+        size_t rx_min_size = (port == USB_CDC_CONFIG_PORT) ? USB_CDC_CONFIG_PORT_RX_BUF_SIZE_MIN : USB_CDC_BUF_SIZE_MIN;
+        if (!usb_cdc_buf_size_valid(port_config->rx_buf_size, rx_min_size) ||
+            !usb_cdc_buf_size_valid(port_config->tx_buf_size, USB_CDC_BUF_SIZE_MIN)) {
+            return 0;
+        }
+    }
+    return usb_cdc_buf_config_used(cdc_config) <= USB_CDC_BUF_ARENA_SIZE;
+}
+
+static void usb_cdc_alloc_buffers(const cdc_config_t *cdc_config) {
+    int config_valid = usb_cdc_buf_config_valid(cdc_config);
+    buf_pool_init(&usb_cdc_buf_pool, usb_cdc_buf_arena, sizeof(usb_cdc_buf_arena));
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        const cdc_port_t *port_config = config_valid ? &cdc_config->port_config[port] : &usb_cdc_default_buf_config;
+        /* Configured sizes always fit the empty pool */
+        uint8_t *rx_data = buf_pool_alloc(&usb_cdc_buf_pool, port_config->rx_buf_size);
+        uint8_t *tx_data = buf_pool_alloc(&usb_cdc_buf_pool, port_config->tx_buf_size);
+        ring_buf_init(&usb_cdc_states[port].rx_buf, rx_data, port_config->rx_buf_size);
+        ring_buf_init(&usb_cdc_states[port].tx_buf, tx_data, port_config->tx_buf_size);
+        usb_cdc_states[port].rx_buf_min_size = port_config->rx_buf_size;
+    }
+}
+
 /* Device Lifecycle */
 
 void usb_cdc_reset() {
@@ -582,6 +1071,12 @@ void usb_cdc_reset() {
     NVIC_EnableIRQ(DMA1_Channel4_IRQn);
     NVIC_SetPriority(DMA1_Channel7_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
     NVIC_EnableIRQ(DMA1_Channel7_IRQn);
+    NVIC_SetPriority(DMA1_Channel3_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+    NVIC_SetPriority(DMA1_Channel5_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+    NVIC_SetPriority(DMA1_Channel6_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    NVIC_EnableIRQ(DMA1_Channel6_IRQn);
     /* 
      * Disable JTAG interface (SWD is still enabled),
      * this frees PA15, PB3, PB4 (needed for DSR/RI inputs).
@@ -602,8 +1097,12 @@ void usb_cdc_reset() {
     RCC->APB1RSTR &= ~(RCC_APB1RSTR_USART3RST);
     memset(&usb_cdc_states, 0, sizeof(usb_cdc_states));
     for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
-        (void)usb_cdc_states[port]._rx_data;
-        (void)usb_cdc_states[port]._tx_data;
+        /* Buffers are about to move, stop DMA left running before reset */
+        usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx)->CCR = 0;
+        usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_tx)->CCR = 0;
+    }
+    usb_cdc_alloc_buffers(&device_config->cdc_config);
+    for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
         usb_cdc_configure_port(port);
         USART_TypeDef *usart = usb_cdc_get_port_usart(port);
         DMA_Channel_TypeDef *dma_rx_ch = usb_cdc_get_port_dma_channel(port, usb_cdc_port_direction_rx);
@@ -614,10 +1113,10 @@ void usb_cdc_reset() {
             usart->CR3 |= USART_CR3_CTSE;
         }
         usb_cdc_set_line_coding(port, &usb_cdc_default_line_coding, 0);
-        dma_rx_ch->CCR |= DMA_CCR1_MINC | DMA_CCR1_CIRC | DMA_CCR1_PL_0;
+        dma_rx_ch->CCR |= DMA_CCR1_MINC | DMA_CCR1_CIRC | DMA_CCR1_PL_0 | DMA_CCR1_HTIE | DMA_CCR1_TCIE;
         dma_rx_ch->CPAR = (uint32_t)&usart->DR;
         dma_rx_ch->CMAR = (uint32_t)usb_cdc_states[port].rx_buf.data;
-        dma_rx_ch->CNDTR = USB_CDC_BUF_SIZE;
+        dma_rx_ch->CNDTR = usb_cdc_states[port].rx_buf.size;
         dma_tx_ch->CCR |= DMA_CCR1_MINC |  DMA_CCR1_DIR | DMA_CCR1_TCIE;
         dma_tx_ch->CPAR = (uint32_t)&usart->DR;
     }
@@ -631,6 +1130,8 @@ void usb_cdc_reset() {
 
 void usb_cdc_enable() {
     usb_cdc_enabled = 1;
+    /* An IN copy may still be reading from rx_buf */
+    usb_ring_buf_dma_wait();
     for (int port=0; port<USB_CDC_NUM_PORTS; port++) {
         USART_TypeDef *usart = usb_cdc_get_port_usart(port);
         usb_cdc_port_start_rx(port);
@@ -646,10 +1147,47 @@ void usb_cdc_suspend() {
     }
 }
 
+RAMFUNC static void usb_cdc_update_port_tx_buf_peak(int port) {
+    ring_buf_t *tx_buf = &usb_cdc_states[port].tx_buf;
+    size_t tx_bytes_available = ring_buf_count(tx_buf);
+    if (tx_bytes_available > usb_cdc_port_counters[port].stats.tx_buf_peak) {
+        usb_cdc_port_counters[port].stats.tx_buf_peak = tx_bytes_available;
+    }
+}
+
+static void usb_cdc_update_port_stats_rates() {
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        usb_cdc_port_counters_t *counters = &usb_cdc_port_counters[port];
+        uint32_t rx_bytes = counters->stats.rx_bytes;
+        uint32_t tx_bytes = counters->stats.tx_bytes;
+        counters->stats.rx_rate = (rx_bytes - counters->rx_bytes_prev) * 1000 / USB_CDC_STATS_RATE_INTERVAL;
+        counters->stats.tx_rate = (tx_bytes - counters->tx_bytes_prev) * 1000 / USB_CDC_STATS_RATE_INTERVAL;
+        counters->rx_bytes_prev = rx_bytes;
+        counters->tx_bytes_prev = tx_bytes;
+    }
+}
+
 void usb_cdc_frame() {
+    SYSTEM_PROFILE_START(profile_start);
     if (usb_cdc_enabled) {
         const device_config_t *device_config = device_config_get();
         static unsigned int ctrl_lines_polling_timer = 0;
+        static unsigned int stats_rate_timer = 0;
+        static unsigned int rx_buf_shrink_timer = 0;
+        if (stats_rate_timer == 0) {
+            stats_rate_timer = USB_CDC_STATS_RATE_INTERVAL - 1;
+            usb_cdc_update_port_stats_rates();
+        } else {
+            stats_rate_timer = stats_rate_timer - 1;
+        }
+        if (rx_buf_shrink_timer == 0) {
+            rx_buf_shrink_timer = USB_CDC_RX_BUF_SHRINK_INTERVAL - 1;
+            for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+                usb_cdc_states[port].rx_buf_shrink_due = 1;
+            }
+        } else {
+            rx_buf_shrink_timer = rx_buf_shrink_timer - 1;
+        }
         if (ctrl_lines_polling_timer == 0) {
             ctrl_lines_polling_timer = USB_CDC_CRTL_LINES_POLLING_INTERVAL;
             for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
@@ -681,27 +1219,49 @@ void usb_cdc_frame() {
             ctrl_lines_polling_timer = ctrl_lines_polling_timer - 1;
         }
     }
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_cdc_frame);
 }
 
 /* Endpoint Handlers */
 
-void usb_cdc_data_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event_t ep_event) {
+RAMFUNC void usb_cdc_data_endpoint_event_handler(uint8_t ep_num, usb_endpoint_event_t ep_event) {
     int port = usb_cdc_data_endpoint_port(ep_num);
     if (port != -1) {
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-        if (ep_event == usb_endpoint_event_data_received) {
-            circ_buf_t *tx_buf = &cdc_state->tx_buf;
-            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
+        if (ep_event == usb_endpoint_event_data_copied) {
+            usb_cdc_update_port_tx_buf_peak(port);
+            usb_cdc_port_start_tx(port);
+            /* A double-buffered endpoint takes the next packet once the copy is complete */
+            if (usb_bytes_available(ep_num)) {
+                cdc_state->usb_rx_pending_ep = ep_num;
+                /* Sent from the DMA interrupt handler, make the main loop resume it */
+                usb_wake();
+            }
+        } else if (ep_event == usb_endpoint_event_data_sent) {
+            /* Load the next packet or the ZLP right away, so that several packets go out within a frame */
+            if ((port != USB_CDC_CONFIG_PORT) || (usb_cdc_config_mode == 0)) {
+                usb_cdc_sync_rx_buffer(port);
+            }
+            usb_cdc_port_send_rx_usb(port);
+        } else if ((ep_event == usb_endpoint_event_data_received) && usb_rx_ready(ep_num)) {
+            ring_buf_t *tx_buf = &cdc_state->tx_buf;
+            size_t tx_space_available = ring_buf_space(tx_buf);
             size_t rx_bytes_available = usb_bytes_available(ep_num);
             if ((port == USB_CDC_CONFIG_PORT) && usb_cdc_config_mode) {
                 usb_cdc_config_mode_process_tx(port);
-            } else {
+            } else if (!cdc_state->usb_rx_pending_ep) {
+                /* A deferred packet is read first, a double-buffered endpoint may receive the next one meanwhile */
                 /* Do not receive data until line state change is complete */
                 if ((tx_space_available < rx_bytes_available) || (cdc_state->line_state_change_pending)) {
                     cdc_state->usb_rx_pending_ep = ep_num;
+                    usb_cdc_port_counters[port].stats.rx_deferred++;
                 } else {
-                    usb_circ_buf_read(ep_num, tx_buf, USB_CDC_BUF_SIZE);
+                    usb_ring_buf_read_dma(ep_num, tx_buf);
+                    usb_cdc_update_port_tx_buf_peak(port);
                     usb_cdc_port_start_tx(port);
+                    if (usb_bytes_available(ep_num)) {
+                        cdc_state->usb_rx_pending_ep = ep_num;
+                    }
                 }
             }
         }
@@ -722,13 +1282,13 @@ usb_status_t usb_cdc_ctrl_process_request(usb_setup_t *setup, void **payload,
                 usb_cdc_line_coding_t *line_coding = (usb_cdc_line_coding_t *)setup->payload;
                 if (setup->wLength == sizeof(usb_cdc_line_coding_t)) {
                     int dry_run = 0;
-                    circ_buf_t *tx_buf = &usb_cdc_states[port].tx_buf;
+                    ring_buf_t *tx_buf = &usb_cdc_states[port].tx_buf;
                     /* 
                      * If the TX buffer is not empty, defer setting
                      * line coding until all data are sent over the serial port.
                      */
                     if ((port != USB_CDC_CONFIG_PORT) || !usb_cdc_config_mode) {
-                        if (circ_buf_count(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE) != 0) {
+                        if (ring_buf_count(tx_buf) != 0) {
                             dry_run = 1;
                             usb_cdc_states[port].line_state_change_pending = 1;
                         }
@@ -752,28 +1312,68 @@ usb_status_t usb_cdc_ctrl_process_request(usb_setup_t *setup, void **payload,
     return usb_status_fail;
 }
 
-void usb_cdc_poll() {
+int usb_cdc_poll() {
+    int busy = 0;
     for (int port = 0; port < (USB_CDC_NUM_PORTS); port++) {
+        SYSTEM_PROFILE_START(profile_start);
         usb_cdc_state_t *cdc_state = &usb_cdc_states[port];
-        circ_buf_t *tx_buf = &cdc_state->tx_buf;
         if ((port != USB_CDC_CONFIG_PORT) || (usb_cdc_config_mode == 0)) {
             usb_cdc_sync_rx_buffer(port);
         }
         usb_cdc_notify_port_state_change(port);
-        usb_cdc_port_send_rx_usb(port);
+        busy |= usb_cdc_port_send_rx_usb(port);
         if (cdc_state->line_state_change_ready) {
+            busy = 1;
             usb_cdc_set_line_coding(port, &cdc_state->line_coding, 0);
             cdc_state->line_state_change_pending = 0;
             cdc_state->line_state_change_ready = 0;
         }
-        if (cdc_state->usb_rx_pending_ep) {
-            size_t tx_space_available = circ_buf_space(tx_buf->head, tx_buf->tail, USB_CDC_BUF_SIZE);
-            size_t rx_bytes_available = usb_bytes_available(cdc_state->usb_rx_pending_ep);
-            if (tx_space_available >= rx_bytes_available) {
-                usb_circ_buf_read(cdc_state->usb_rx_pending_ep, tx_buf, USB_CDC_BUF_SIZE);
-                usb_cdc_port_start_tx(port);
-                cdc_state->usb_rx_pending_ep = 0;
-            }
+        busy |= usb_cdc_port_resume_rx(port);
+        if (usb_cdc_enabled && ((port != USB_CDC_CONFIG_PORT) || (usb_cdc_config_mode == 0))) {
+            usb_cdc_port_resize_rx_buf(port);
         }
+        SYSTEM_PROFILE_STOP(profile_start, (system_profile_point_t)(system_profile_point_cdc_poll_port1 + port));
+    }
+    return busy;
+}
+
+/* Port Buffers */
+
+size_t usb_cdc_get_port_rx_buf_size(int port) {
+    if (port < USB_CDC_NUM_PORTS) {
+        return usb_cdc_states[port].rx_buf.size;
+    }
+    return 0;
+}
+
+size_t usb_cdc_get_buf_pool_free() {
+    return buf_pool_free_size(&usb_cdc_buf_pool);
+}
+
+/* Port Statistics */
+
+const usb_cdc_port_stats_t *usb_cdc_get_port_stats(int port) {
+    if (port < USB_CDC_NUM_PORTS) {
+        return &usb_cdc_port_counters[port].stats;
+    }
+    return 0;
+}
+
+void usb_cdc_reset_port_stats(int port) {
+    if (port < USB_CDC_NUM_PORTS) {
+        memset(&usb_cdc_port_counters[port], 0, sizeof(usb_cdc_port_counters[port]));
+    }
+}
+
+const usb_cdc_rx_latency_t *usb_cdc_get_port_rx_latency(int port) {
+    if (port < USB_CDC_NUM_PORTS) {
+        return &usb_cdc_port_rx_latency[port];
+    }
+    return 0;
+}
+
+void usb_cdc_reset_port_rx_latency(int port) {
+    if (port < USB_CDC_NUM_PORTS) {
+        memset(&usb_cdc_port_rx_latency[port], 0, sizeof(usb_cdc_port_rx_latency[port]));
     }
 }
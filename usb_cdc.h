@@ -103,6 +103,7 @@ typedef uint16_t usb_cdc_serial_state_t;
 #define USB_CDC_SERIAL_STATE_DCD            0x01
 #define USB_CDC_SERIAL_STATE_DSR            0x02
 #define USB_CDC_SERIAL_STATE_RI             0x08
+#define USB_CDC_SERIAL_STATE_FRAMING_ERROR  0x10
 #define USB_CDC_SERIAL_STATE_PARITY_ERROR   0x20
 #define USB_CDC_SERIAL_STATE_OVERRUN        0x40
 
@@ -199,12 +200,63 @@ void usb_cdc_reconfigure(void);
 /* CDC Device Definitions */
 
 #define USB_CDC_NUM_PORTS                       3
-#define USB_CDC_BUF_SIZE                        0x400
+#define USB_CDC_BUF_SIZE                        0x400   /* default size of each port buffer */
+#define USB_CDC_BUF_SIZE_MIN                    0x40    /* one full-speed bulk packet */
+#define USB_CDC_CONFIG_PORT_RX_BUF_SIZE_MIN     0x400   /* shell output of a single command */
+#define USB_CDC_BUF_ARENA_SIZE                  0x2000  /* see the SRAM budget in usb_cdc.c */
+#define USB_CDC_RX_BUF_SIZE_MAX                 0x1000
+#define USB_CDC_RX_BUF_SHRINK_INTERVAL          1000 /* ms */
 #define USB_CDC_CRTL_LINES_POLLING_INTERVAL     20 /* ms */
 #define USB_CDC_CONFIG_PORT                     0
 
 /* CDC Polling */
 
-void usb_cdc_poll(void);
+int usb_cdc_poll(void);
+
+/* CDC Port Statistics */
+
+#define USB_CDC_STATS_RATE_INTERVAL             1000 /* ms */
+
+typedef struct {
+    uint32_t    rx_bytes;       /* UART RX -> USB IN */
+    uint32_t    tx_bytes;       /* USB OUT -> UART TX */
+    uint32_t    rx_rate;        /* bytes/s over the last rate interval */
+    uint32_t    tx_rate;        /* bytes/s over the last rate interval */
+    uint32_t    rx_overruns;    /* RX DMA overwrote data not yet sent to the host */
+    uint32_t    rx_overrun_bytes; /* bytes overwritten before they were sent to the host */
+    uint32_t    rx_parity_errors;
+    uint32_t    rx_framing_errors;
+    uint32_t    rx_noise_errors;
+    uint32_t    rx_usart_overruns;  /* USART data register overwritten before DMA read it */
+    uint32_t    rx_buf_peak;    /* max bytes waiting in the RX buffer */
+    uint32_t    tx_buf_peak;    /* max bytes waiting in the TX buffer */
+    uint32_t    rx_deferred;    /* OUT packets left in the endpoint until TX buffer space is available */
+    uint32_t    rts_throttled;  /* RTS forced inactive because the RX buffer is half full */
+    uint32_t    rx_zlps;        /* zero length packets sent to terminate IN transfers */
+    uint32_t    rx_buf_grows;   /* RX buffer doubled with memory from the buffer pool */
+    uint32_t    rx_buf_shrinks; /* RX buffer halved, memory returned to the buffer pool */
+    uint32_t    rx_buf_grow_failures; /* RX buffer could not grow, the buffer pool was exhausted */
+} usb_cdc_port_stats_t;
+
+const usb_cdc_port_stats_t *usb_cdc_get_port_stats(int port);
+void usb_cdc_reset_port_stats(int port);
+
+/* CDC Port Buffers */
+
+size_t usb_cdc_get_port_rx_buf_size(int port);
+size_t usb_cdc_get_buf_pool_free(void);
+
+/* CDC RX Latency, UART RX buffer to USB IN endpoint */
+
+#define USB_CDC_RX_LATENCY_BUCKETS              16
+#define USB_CDC_RX_LATENCY_MARKS                8
+
+typedef struct {
+    uint32_t    buckets[USB_CDC_RX_LATENCY_BUCKETS]; /* bucket n: [2^n, 2^(n+1)) us, bucket 0 includes 0 us */
+    uint32_t    max_us;
+} usb_cdc_rx_latency_t;
+
+const usb_cdc_rx_latency_t *usb_cdc_get_port_rx_latency(int port);
+void usb_cdc_reset_port_rx_latency(int port);
 
 #endif /* USB_CDC_H */
@@ -10,6 +10,7 @@
 #include "usb_core.h"
 #include "usb_std.h"
 #include "usb_cdc.h"
+#include "usb_vendor.h"
 #include "usb_descriptors.h"
 #include "usb_io.h"
 #include "usb_uid.h"
@@ -54,8 +55,8 @@ void usb_device_handle_frame() {
     usb_cdc_frame();
 }
 
-void usb_device_poll() {
-    usb_cdc_poll();
+int usb_device_poll() {
+    return usb_cdc_poll();
 }
 
 /* Device Descriptor Requests Handling */
@@ -173,6 +174,10 @@ usb_status_t usb_control_endpoint_process_request(usb_setup_t *setup,
     if (status != usb_status_fail) {
         return status;
     }
+    status = usb_vendor_ctrl_process_request(setup, payload, payload_size, tx_callback_ptr);
+    if (status != usb_status_fail) {
+        return status;
+    }
 
     if (setup->type == usb_setup_type_standard) {
         switch (setup->recepient) {
@@ -932,6 +932,6 @@ void usb_device_handle_configured(void);
 void usb_device_handle_suspend(void);
 void usb_device_handle_wakeup(void);
 void usb_device_handle_frame(void);
-void usb_device_poll(void);
+int usb_device_poll(void);
 
 #endif /* USB_CORE_H */
@@ -10,7 +10,7 @@
 #include "usb_descriptors.h"
 #include <string.h>
 #define USB_CONTROL_ENDPOINT_SIZE           16
-#define USB_CDC_INTERRUPT_ENDPOINT_SIZE     16
+#define USB_CDC_INTERRUPT_ENDPOINT_SIZE     10 /* serial state notification size */
 #define USB_CDC_DATA_ENDPOINT_SIZE_SMALL    32
 #define USB_CDC_DATA_ENDPOINT_SIZE_LARGE    64
 
@@ -20,56 +20,63 @@
 
 #define USB_CDC_INTERRUPT_ENDPOINT_POLLING_INTERVAL 20
 
-const usb_endpoint_t usb_endpoints[usb_endpoint_address_last] = {
-    /*  Default Control Endpoint */
-    {
-        .type       = usb_endpoint_type_control,
-        .rx_size    = USB_CONTROL_ENDPOINT_SIZE,
-        .tx_size    = USB_CONTROL_ENDPOINT_SIZE,
-        .event_handler = usb_control_endpoint_event_handler,
-    },
-    /*  CDC 0 Interrupt Endpoint */
-    { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
-        .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
-    },
-     /*  CDC 0 Data Endpoint */
-    { 
-        .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_0_ENDPOINT_SIZE,
-        .tx_size    = USB_CDC_DATA_0_ENDPOINT_SIZE,
-        .event_handler = usb_cdc_data_endpoint_event_handler,
-    },
-    /*  CDC 1 Interrupt Endpoint */
-    { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
-        .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
-    },
-     /*  CDC 1 Data Endpoint */
-    { 
-        .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_1_ENDPOINT_SIZE,
-        .tx_size    = USB_CDC_DATA_1_ENDPOINT_SIZE,
-        .event_handler = usb_cdc_data_endpoint_event_handler,
-    },
-    /*  CDC 2 Interrupt Endpoint */
-    { 
-        .type       = usb_endpoint_type_interrupt,
-        .rx_size    = 0,
-        .tx_size    = USB_CDC_INTERRUPT_ENDPOINT_SIZE,
-        .event_handler = 0,
-    },
-     /*  CDC 2 Data Endpoint */
-    { 
-        .type       = usb_endpoint_type_bulk,
-        .rx_size    = USB_CDC_DATA_2_ENDPOINT_SIZE,
-        .tx_size    = USB_CDC_DATA_2_ENDPOINT_SIZE,
-        .event_handler = usb_cdc_data_endpoint_event_handler,
+/* Endpoints and Packet Memory Layout */
+
+/*
+ * The USB peripheral has 8 endpoint registers and all of them are used. A
+ * double-buffered bulk endpoint works in one direction only, so a port needs
+ * separate IN and OUT endpoints for it. Only port 0 gets them, the spare 8th
+ * register is its OUT endpoint. Port 1 and 2 keep single-buffered
+ * bidirectional endpoints, there is neither a register nor packet memory left
+ * to split them. Port 0 uses 32 byte packets so its four buffers fit in the
+ * packet memory of one 64 byte bidirectional endpoint.
+ *
+ * usb_endpoints and the packet memory layout are both generated from this
+ * list, each entry is X(name, type, rx_size, tx_size, double_buffered,
+ * event_handler) and name selects usb_endpoint_address_<name>.
+ */
+#define USB_ENDPOINTS(X) \
+    X(control,          usb_endpoint_type_control,      USB_CONTROL_ENDPOINT_SIZE,      USB_CONTROL_ENDPOINT_SIZE,          0, usb_control_endpoint_event_handler) \
+    X(cdc_0_interrupt,  usb_endpoint_type_interrupt,    0,                              USB_CDC_INTERRUPT_ENDPOINT_SIZE,    0, 0) \
+    X(cdc_0_data,       usb_endpoint_type_bulk,         0,                              USB_CDC_DATA_0_ENDPOINT_SIZE,       1, usb_cdc_data_endpoint_event_handler) \
+    X(cdc_1_interrupt,  usb_endpoint_type_interrupt,    0,                              USB_CDC_INTERRUPT_ENDPOINT_SIZE,    0, 0) \
+    X(cdc_1_data,       usb_endpoint_type_bulk,         USB_CDC_DATA_1_ENDPOINT_SIZE,   USB_CDC_DATA_1_ENDPOINT_SIZE,       0, usb_cdc_data_endpoint_event_handler) \
+    X(cdc_2_interrupt,  usb_endpoint_type_interrupt,    0,                              USB_CDC_INTERRUPT_ENDPOINT_SIZE,    0, 0) \
+    X(cdc_2_data,       usb_endpoint_type_bulk,         USB_CDC_DATA_2_ENDPOINT_SIZE,   USB_CDC_DATA_2_ENDPOINT_SIZE,       0, usb_cdc_data_endpoint_event_handler) \
+    X(cdc_0_data_out,   usb_endpoint_type_bulk,         USB_CDC_DATA_0_ENDPOINT_SIZE,   0,                                  1, usb_cdc_data_endpoint_event_handler)
+
+/* Endpoint buffers follow the buffer table in endpoint order, this struct only gives their offsets */
+#define USB_PMA_LAYOUT_ENTRY(name, type, rx_size, tx_size, double_buffered, event_handler) \
+    uint8_t name[USB_PMA_BUFFERS_SIZE(rx_size, tx_size, double_buffered)];
+
+typedef struct {
+    USB_ENDPOINTS(USB_PMA_LAYOUT_ENTRY)
+} usb_pma_layout_t;
+
+#define USB_PMA_OFFSET(name)    (USB_BTABLE_SIZE + offsetof(usb_pma_layout_t, name))
+#define USB_PMA_USED            (USB_BTABLE_SIZE + sizeof(usb_pma_layout_t))
+
+/* Fail to compile with a negative array size if a buffer is not 16-bit aligned or the buffers do not fit */
+#define USB_PMA_ALIGNMENT_CHECK(name, type, rx_size, tx_size, double_buffered, event_handler) \
+    typedef char usb_pma_alignment_check_##name[((USB_PMA_OFFSET(name) & 0x01) == 0) ? 1 : -1];
+
+USB_ENDPOINTS(USB_PMA_ALIGNMENT_CHECK)
+typedef char usb_pma_overflow_check[(USB_PMA_USED <= USB_PMA_SIZE) ? 1 : -1];
+
+const uint16_t usb_pma_slack = USB_PMA_SIZE - USB_PMA_USED;
+
+#define USB_ENDPOINT_ENTRY(name, ep_type, ep_rx_size, ep_tx_size, ep_double_buffered, ep_event_handler) \
+    [usb_endpoint_address_##name] = { \
+        .type               = ep_type, \
+        .rx_size            = ep_rx_size, \
+        .tx_size            = ep_tx_size, \
+        .double_buffered    = ep_double_buffered, \
+        .pma_offset         = USB_PMA_OFFSET(name), \
+        .event_handler      = ep_event_handler, \
     },
+
+const usb_endpoint_t usb_endpoints[usb_endpoint_address_last] = {
+    USB_ENDPOINTS(USB_ENDPOINT_ENTRY)
 };
 
 const usb_string_descriptor_t usb_string_lang ={
@@ -218,7 +225,7 @@ const usb_device_configuration_descriptor_t usb_configuration_descriptor = {
     .data_eprx_0 = {
         .bLength                = sizeof(usb_configuration_descriptor.data_eprx_0),
         .bDescriptorType        = usb_descriptor_type_endpoint,
-        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_0_data,
+        .bEndpointAddress       = usb_endpoint_direction_out | usb_endpoint_address_cdc_0_data_out,
         .bmAttributes           = usb_endpoint_type_bulk,
         .wMaxPacketSize         = USB_CDC_DATA_0_ENDPOINT_SIZE,
         .bInterval              = 0,
@@ -43,11 +43,15 @@ enum {
     usb_endpoint_address_cdc_1_data         = 0x04,
     usb_endpoint_address_cdc_2_interrupt    = 0x05,
     usb_endpoint_address_cdc_2_data         = 0x06,
+    usb_endpoint_address_cdc_0_data_out     = 0x07,
     usb_endpoint_address_last
 };
 
 extern const usb_endpoint_t usb_endpoints[usb_endpoint_address_last];
 
+/* Packet memory left unused by the endpoint buffers, bytes */
+extern const uint16_t usb_pma_slack;
+
 /* Interfaces */
 
 enum {
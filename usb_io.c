@@ -6,6 +6,9 @@
 
 #include "stm32f10x.h"
 #include "system_interrupts.h"
+#include "system_profile.h"
+#include "system_ramfunc.h"
+#include "usb_trace.h"
 #include "status_led.h"
 #include "usb_descriptors.h"
 #include "usb_core.h"
@@ -14,24 +17,147 @@
 
 static volatile usb_btable_entity_t *usb_btable = (usb_btable_entity_t*)USB_PMAADDR;
 
+/* Double-Buffered Endpoints */
+
+/*
+ * A double-buffered bulk endpoint works in one direction only and uses both
+ * buffer descriptors of its buffer table entry as packet buffers 0 (tx_offset)
+ * and 1 (rx_offset). The peripheral uses the buffer selected by the data toggle
+ * bit, the application uses the other one, selected by the SW_BUF bit: DTOG_RX
+ * for IN and DTOG_TX for OUT endpoints. The application hands its buffer over
+ * by toggling SW_BUF, the peripheral NAKs while both bits select the same buffer.
+ */
+
+static volatile struct {
+    uint8_t tx_busy;    /* IN: a packet is handed over to the peripheral */
+    uint8_t tx_queued;  /* IN: the application buffer is filled, handed over on CTR_TX */
+    uint8_t rx_held;    /* OUT: the application buffer holds a received packet */
+} usb_io_dbl_buf[USB_MAX_ENDPOINTS];
+
+static void usb_io_toggle_sw_buf(uint8_t ep_num, ep_reg_t sw_buf) {
+    ep_reg_t *ep_reg = ep_regs(ep_num);
+    *ep_reg = (*ep_reg & USB_EPREG_MASK) | sw_buf | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+}
+
+/* Packet buffer of the application side and its byte count register */
+
+static volatile pb_aligned_word_t *usb_io_rx_buf(uint8_t ep_num, uint32_t *pb_addr) {
+    if (usb_endpoints[ep_num].double_buffered && (*ep_regs(ep_num) & USB_EP_DTOG_TX)) {
+        *pb_addr = USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1);
+        return &usb_btable[ep_num].rx_count;
+    }
+    if (usb_endpoints[ep_num].double_buffered) {
+        *pb_addr = USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1);
+        return &usb_btable[ep_num].tx_count;
+    }
+    *pb_addr = USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1);
+    return &usb_btable[ep_num].rx_count;
+}
+
+static volatile pb_aligned_word_t *usb_io_tx_buf(uint8_t ep_num, uint32_t *pb_addr) {
+    if (usb_endpoints[ep_num].double_buffered && (*ep_regs(ep_num) & USB_EP_DTOG_RX)) {
+        *pb_addr = USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1);
+        return &usb_btable[ep_num].rx_count;
+    }
+    *pb_addr = USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1);
+    return &usb_btable[ep_num].tx_count;
+}
+
+/* Byte count of the packet buffer the peripheral has just sent */
+static pb_word_t usb_io_tx_sent_count(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].double_buffered && !(*ep_regs(ep_num) & USB_EP_DTOG_TX)) {
+        return usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
+    }
+    return usb_btable[ep_num].tx_count & USB_COUNT0_RX_COUNT0_RX;
+}
+
+/* Takes the next received packet if the application buffer is free */
+static void usb_io_rx_take(uint8_t ep_num) {
+    ep_reg_t ep_reg_value = *ep_regs(ep_num);
+    if (!usb_io_dbl_buf[ep_num].rx_held &&
+        (!(ep_reg_value & USB_EP_DTOG_RX) == !(ep_reg_value & USB_EP_DTOG_TX))) {
+        usb_io_toggle_sw_buf(ep_num, USB_EP_DTOG_TX);
+        usb_io_dbl_buf[ep_num].rx_held = 1;
+    }
+}
+
+/* Returns the application buffer to the peripheral once the packet is read */
+static void usb_io_rx_release(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].double_buffered) {
+        usb_io_dbl_buf[ep_num].rx_held = 0;
+        usb_io_rx_take(ep_num);
+    } else {
+        ep_reg_t *ep_reg = ep_regs(ep_num);
+        *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    }
+}
+
+/* Hands the filled application buffer over to the peripheral */
+static void usb_io_tx_release(uint8_t ep_num) {
+    if (usb_endpoints[ep_num].double_buffered) {
+        if (usb_io_dbl_buf[ep_num].tx_busy) {
+            usb_io_dbl_buf[ep_num].tx_queued = 1;
+        } else {
+            usb_io_dbl_buf[ep_num].tx_busy = 1;
+            usb_io_toggle_sw_buf(ep_num, USB_EP_DTOG_RX);
+        }
+    } else {
+        ep_reg_t *ep_reg = ep_regs(ep_num);
+        *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    }
+}
+
+/* Hands the queued buffer over once the peripheral has sent a packet */
+static void usb_io_tx_complete(uint8_t ep_num) {
+    usb_io_dbl_buf[ep_num].tx_busy = 0;
+    if (usb_io_dbl_buf[ep_num].tx_queued) {
+        usb_io_dbl_buf[ep_num].tx_queued = 0;
+        usb_io_dbl_buf[ep_num].tx_busy = 1;
+        usb_io_toggle_sw_buf(ep_num, USB_EP_DTOG_RX);
+    }
+}
+
 /* USB Initialization After Reset */
 
+static pb_word_t usb_io_rx_count_blocks(uint8_t rx_size) {
+    if (rx_size > USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT) {
+        return (((rx_size / USB_BTABLE_LARGE_BLOCK_SIZE) - 1) << USB_COUNT0_RX_NUM_BLOCK_Pos) | USB_COUNT0_RX_BLSIZE;
+    }
+    return (rx_size / USB_BTABLE_SMALL_BLOCK_SIZE) << USB_COUNT0_RX_NUM_BLOCK_Pos;
+}
+
 void usb_io_reset() {
-    uint16_t offset = USB_BTABLE_SIZE;
     for (uint8_t ep_num=0; ep_num<USB_NUM_ENDPOINTS; ep_num++) {
         ep_reg_t ep_type = 0;
         ep_reg_t *ep_reg = ep_regs(ep_num);
+        uint16_t offset = usb_endpoints[ep_num].pma_offset;
+        usb_io_dbl_buf[ep_num].tx_busy = 0;
+        usb_io_dbl_buf[ep_num].tx_queued = 0;
+        usb_io_dbl_buf[ep_num].rx_held = 0;
+        if (usb_endpoints[ep_num].double_buffered) {
+            uint8_t tx_size = usb_endpoints[ep_num].tx_size;
+            uint8_t rx_size = usb_endpoints[ep_num].rx_size;
+            uint8_t size = tx_size ? tx_size : rx_size;
+            usb_btable[ep_num].tx_offset = offset;
+            offset += size;
+            usb_btable[ep_num].rx_offset = offset;
+            if (tx_size) {
+                usb_btable[ep_num].tx_count = 0;
+                usb_btable[ep_num].rx_count = 0;
+                *ep_reg = USB_EP_TX_VALID | USB_EP_RX_DIS | USB_EP_KIND | USB_EP_BULK | ep_num;
+            } else {
+                usb_btable[ep_num].tx_count = usb_io_rx_count_blocks(rx_size);
+                usb_btable[ep_num].rx_count = usb_io_rx_count_blocks(rx_size);
+                /* SW_BUF selects buffer 1, the peripheral receives into buffer 0 first */
+                *ep_reg = USB_EP_RX_VALID | USB_EP_TX_DIS | USB_EP_DTOG_TX | USB_EP_KIND | USB_EP_BULK | ep_num;
+            }
+            continue;
+        }
         usb_btable[ep_num].tx_offset = offset;
         usb_btable[ep_num].tx_count = 0;
         offset += usb_endpoints[ep_num].tx_size;
         usb_btable[ep_num].rx_offset = offset;
-        if (usb_endpoints[ep_num].rx_size > USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT) {
-            usb_btable[ep_num].rx_count = ((usb_endpoints[ep_num].rx_size / USB_BTABLE_LARGE_BLOCK_SIZE) - 1) << USB_COUNT0_RX_NUM_BLOCK_Pos;
-            usb_btable[ep_num].rx_count |= USB_COUNT0_RX_BLSIZE;
-        } else {
-            usb_btable[ep_num].rx_count = (usb_endpoints[ep_num].rx_size / USB_BTABLE_SMALL_BLOCK_SIZE) << USB_COUNT0_RX_NUM_BLOCK_Pos;
-        }
-        offset += usb_endpoints[ep_num].rx_size;
+        usb_btable[ep_num].rx_count = usb_io_rx_count_blocks(usb_endpoints[ep_num].rx_size);
         switch(usb_endpoints[ep_num].type) {
         case usb_endpoint_type_control:
             ep_type = USB_EP_CONTROL;
@@ -52,6 +178,9 @@ void usb_io_reset() {
     USB->DADDR = USB_DADDR_EF;
 }
 
+static void usb_io_dma_init(void);
+static void usb_io_dma_abort(void);
+
 void usb_io_init() {
     /* Force USB re-enumeration */
     RCC->APB2ENR |= RCC_APB2ENR_IOPAEN;
@@ -73,17 +202,44 @@ void usb_io_init() {
     USB->DADDR = 0;
     USB->ISTR = 0;
     USB->CNTR = USB_CNTR_RESETM;
+    usb_io_dma_init();
+#if defined(USB_INTERRUPT_DRIVEN)
+    NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, SYSTEM_INTERRUTPS_PRIORITY_BASE);
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+#endif
 }
 
 /* Get Number of RX/TX Bytes Available  */
-size_t usb_bytes_available(uint8_t ep_num) {
-    return usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
+
+static int usb_io_dma_is_reading(uint8_t ep_num);
+static int usb_io_dma_is_sending(uint8_t ep_num);
+
+RAMFUNC int usb_rx_ready(uint8_t ep_num) {
+    if (usb_io_dma_is_reading(ep_num)) {
+        return 0;
+    }
+    return !usb_endpoints[ep_num].double_buffered || usb_io_dbl_buf[ep_num].rx_held;
+}
+
+RAMFUNC size_t usb_bytes_available(uint8_t ep_num) {
+    uint32_t pb_addr;
+    if (!usb_rx_ready(ep_num)) {
+        return 0;
+    }
+    return *usb_io_rx_buf(ep_num, &pb_addr) & USB_COUNT0_RX_COUNT0_RX;
 }
 
 size_t usb_space_available(uint8_t ep_num) {
     ep_reg_t *ep_reg = ep_regs(ep_num);
     size_t tx_space_available = 0;
-    if ((*ep_reg & USB_EPTX_STAT) == USB_EP_TX_NAK) {
+    if (usb_io_dma_is_sending(ep_num)) {
+        return 0;
+    }
+    if (usb_endpoints[ep_num].double_buffered) {
+        if (!(usb_io_dbl_buf[ep_num].tx_busy && usb_io_dbl_buf[ep_num].tx_queued)) {
+            tx_space_available = usb_endpoints[ep_num].tx_size;
+        }
+    } else if ((*ep_reg & USB_EPTX_STAT) == USB_EP_TX_NAK) {
         tx_space_available = usb_endpoints[ep_num].tx_size;
     }
     return tx_space_available;
@@ -92,28 +248,32 @@ size_t usb_space_available(uint8_t ep_num) {
 /* Endpoint Read/Write Operations */
 
 int usb_read(uint8_t ep_num, void *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1));
-    pb_word_t ep_bytes_count = usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *rx_count = usb_io_rx_buf(ep_num, &pb_addr);
+    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)pb_addr;
+    pb_word_t ep_bytes_count = usb_bytes_available(ep_num);
     pb_word_t words_left = ep_bytes_count>>1;
     pb_word_t *buf_p = (pb_word_t*)buf;
     if (ep_bytes_count > buf_size) {
         return -1;
     }
-    usb_btable[ep_num].rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
+    if (!usb_endpoints[ep_num].double_buffered) {
+        *rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
+    }
     while(words_left--) {
          *buf_p++ = (ep_buf++)->data;
     }
     if (ep_bytes_count & 0x01) {
         *((uint8_t*)buf_p) = (uint8_t)ep_buf->data;
     }
-    *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    usb_io_rx_release(ep_num);
     return ep_bytes_count;
 }
 
 size_t usb_send(uint8_t ep_num, const void *buf, size_t count) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1));
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *tx_count = usb_io_tx_buf(ep_num, &pb_addr);
+    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)pb_addr;
     pb_word_t *buf_p = (pb_word_t*)buf;
     pb_word_t words_left;
     size_t tx_space_available = usb_endpoints[ep_num].tx_size;
@@ -127,62 +287,309 @@ size_t usb_send(uint8_t ep_num, const void *buf, size_t count) {
     if (count & 0x01) {
         (ep_buf)->data = (uint8_t)*buf_p;
     }
-    usb_btable[ep_num].tx_count = count;
-    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    *tx_count = count;
+    usb_io_tx_release(ep_num);
     return count;
 }
 
 
-/* Circular Buffer Read/Write Operations */
+/* Packet Buffer Span Copy */
 
-/* NOTE: usb_circ_buf_read assumes enough buffer space is available */
-size_t usb_circ_buf_read(uint8_t ep_num, circ_buf_t *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].rx_offset<<1));
-    pb_word_t ep_bytes_count = usb_btable[ep_num].rx_count & USB_COUNT0_RX_COUNT0_RX;
-    size_t words_left = ep_bytes_count>>1;
-    usb_btable[ep_num].rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
-    while(words_left--) {
-        buf->data[buf->head] = (uint8_t)(ep_buf->data);
-        buf->head = (buf->head + 1) & (buf_size - 1);
-        buf->data[buf->head] = (uint8_t)(((ep_buf++)->data) >> 8);
-        buf->head = (buf->head + 1) & (buf_size - 1);
+/*
+ * Ring buffer spans start at arbitrary byte offsets, so ring data is
+ * accessed through an unaligned half-word type, which Cortex-M3 handles
+ * with single LDRH/STRH. pb_offset is the byte offset in the packet buffer
+ * and may be odd when the copy continues after an odd-length first span.
+ */
+
+typedef struct {
+    uint16_t data;
+} __attribute__ ((packed, may_alias)) usb_unaligned_word_t;
+
+#define USB_PB_COPY_UNROLL 4 /* half-words per iteration */
+
+RAMFUNC static void usb_pb_read_span(uint8_t *buf, volatile usb_pbuffer_data_t *ep_buf, size_t pb_offset, size_t count) {
+    size_t words_left;
+    ep_buf += (pb_offset >> 1);
+    if (count && (pb_offset & 0x01)) {
+        *buf++ = (uint8_t)((ep_buf++)->data >> 8);
+        count--;
+    }
+    words_left = count >> 1;
+    while (words_left >= USB_PB_COPY_UNROLL) {
+        ((usb_unaligned_word_t*)buf)[0].data = ep_buf[0].data;
+        ((usb_unaligned_word_t*)buf)[1].data = ep_buf[1].data;
+        ((usb_unaligned_word_t*)buf)[2].data = ep_buf[2].data;
+        ((usb_unaligned_word_t*)buf)[3].data = ep_buf[3].data;
+        buf += (USB_PB_COPY_UNROLL << 1);
+        ep_buf += USB_PB_COPY_UNROLL;
+        words_left -= USB_PB_COPY_UNROLL;
+    }
+    while (words_left--) {
+        ((usb_unaligned_word_t*)buf)->data = (ep_buf++)->data;
+        buf += 2;
     }
-    if (ep_bytes_count & 0x1) {
-        buf->data[buf->head] = (uint8_t)(ep_buf->data);
-        buf->head = (buf->head + 1) & (buf_size - 1);
+    if (count & 0x01) {
+        *buf = (uint8_t)(ep_buf->data);
+    }
+}
+
+RAMFUNC static void usb_pb_write_span(volatile usb_pbuffer_data_t *ep_buf, size_t pb_offset, const uint8_t *buf, size_t count) {
+    size_t words_left;
+    ep_buf += (pb_offset >> 1);
+    if (count && (pb_offset & 0x01)) {
+        ep_buf->data = (ep_buf->data & 0x00ff) | ((pb_word_t)*buf++ << 8);
+        ep_buf++;
+        count--;
     }
-    *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    words_left = count >> 1;
+    while (words_left >= USB_PB_COPY_UNROLL) {
+        ep_buf[0].data = ((const usb_unaligned_word_t*)buf)[0].data;
+        ep_buf[1].data = ((const usb_unaligned_word_t*)buf)[1].data;
+        ep_buf[2].data = ((const usb_unaligned_word_t*)buf)[2].data;
+        ep_buf[3].data = ((const usb_unaligned_word_t*)buf)[3].data;
+        buf += (USB_PB_COPY_UNROLL << 1);
+        ep_buf += USB_PB_COPY_UNROLL;
+        words_left -= USB_PB_COPY_UNROLL;
+    }
+    while (words_left--) {
+        (ep_buf++)->data = ((const usb_unaligned_word_t*)buf)->data;
+        buf += 2;
+    }
+    if (count & 0x01) {
+        ep_buf->data = *buf;
+    }
+}
+
+/* Ring Buffer Read/Write Operations */
+
+/* NOTE: usb_ring_buf_read assumes enough buffer space is available */
+RAMFUNC size_t usb_ring_buf_read(uint8_t ep_num, ring_buf_t *buf) {
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *rx_count = usb_io_rx_buf(ep_num, &pb_addr);
+    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)pb_addr;
+    pb_word_t ep_bytes_count = usb_bytes_available(ep_num);
+    size_t span_size, next_span_size;
+    uint8_t *span;
+    if (!usb_rx_ready(ep_num)) {
+        /* No packet held or a DMA copy owns it, releasing would drop it */
+        return 0;
+    }
+    span = ring_buf_peek_write(buf, 0, &span_size);
+    if (!usb_endpoints[ep_num].double_buffered) {
+        *rx_count &= ~USB_COUNT0_RX_COUNT0_RX;
+    }
+    if (span_size > ep_bytes_count) {
+        span_size = ep_bytes_count;
+    }
+    SYSTEM_PROFILE_START(profile_start);
+    usb_pb_read_span(span, ep_buf, 0, span_size);
+    span = ring_buf_peek_write(buf, span_size, &next_span_size);
+    usb_pb_read_span(span, ep_buf, span_size, ep_bytes_count - span_size);
+    if (ep_bytes_count) {
+        SYSTEM_PROFILE_STOP_PER(profile_start, system_profile_point_usb_pb_read, ep_bytes_count, 64);
+    }
+    ring_buf_commit_write(buf, ep_bytes_count);
+    usb_io_rx_release(ep_num);
     return ep_bytes_count;
 }
 
-/* NOTE: usb_circ_buf_send assumes endpoint is ready to send */
-size_t usb_circ_buf_send(uint8_t ep_num, circ_buf_t *buf, size_t buf_size) {
-    ep_reg_t *ep_reg = ep_regs(ep_num);
-    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)(USB_PMAADDR + (usb_btable[ep_num].tx_offset<<1));
-    size_t count = circ_buf_count(buf->head, buf->tail, buf_size);
+/* NOTE: usb_ring_buf_send assumes endpoint is ready to send */
+size_t usb_ring_buf_send(uint8_t ep_num, ring_buf_t *buf) {
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *tx_count = usb_io_tx_buf(ep_num, &pb_addr);
+    usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)pb_addr;
+    size_t count = ring_buf_count(buf);
     size_t tx_space_available = usb_endpoints[ep_num].tx_size;
-    size_t words_left;
+    size_t span_size, next_span_size;
+    uint8_t *span = ring_buf_peek_read(buf, 0, &span_size);
     if (count > tx_space_available) {
         count = tx_space_available;
     }
-    words_left = count >> 1;
-    while (words_left--) {
-        pb_word_t pb_word = buf->data[buf->tail];
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
-        pb_word |= ((uint16_t)buf->data[buf->tail]) << 8;
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
-        (ep_buf++)->data = pb_word;
-    }
-    if (count & 0x1) {
-        (ep_buf)->data = buf->data[buf->tail];
-        buf->tail = (buf->tail + 1) & (buf_size - 1);
-    }
-    usb_btable[ep_num].tx_count = count;
-    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+    if (span_size > count) {
+        span_size = count;
+    }
+    SYSTEM_PROFILE_START(profile_start);
+    usb_pb_write_span(ep_buf, 0, span, span_size);
+    span = ring_buf_peek_read(buf, span_size, &next_span_size);
+    usb_pb_write_span(ep_buf, span_size, span, count - span_size);
+    if (count) {
+        SYSTEM_PROFILE_STOP_PER(profile_start, system_profile_point_usb_pb_write, count, 64);
+    }
+    ring_buf_commit_read(buf, count);
+    *tx_count = count;
+    usb_io_tx_release(ep_num);
     return count;
 }
 
+/* Ring Buffer DMA Read/Write Operations */
+
+/*
+ * DMA1 Channel 1 runs in memory-to-memory mode with the packet buffer on the
+ * peripheral side: 32-bit accesses with a 4-byte stride on the packet buffer,
+ * 16-bit accesses on the ring buffer. A packet wrapping around the end of the
+ * ring is copied as two spans, the second one is started from the interrupt
+ * handler. A trailing odd byte is copied by the CPU before DMA is started.
+ */
+
+#define USB_IO_DMA_CHANNEL  DMA1_Channel1
+
+static struct {
+    volatile uint8_t    busy;
+    uint8_t             ep_num;
+    uint8_t             read;
+    ring_buf_t          *buf;
+    size_t              count;
+    uint8_t             *next_span;
+    uint32_t            next_pb_addr;
+    size_t              next_words;
+} usb_io_dma;
+
+static void usb_io_dma_init() {
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    USB_IO_DMA_CHANNEL->CCR = 0;
+    NVIC_SetPriority(DMA1_Channel1_IRQn, SYSTEM_INTERRUTPS_PRIORITY_HIGH);
+    NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+}
+
+static void usb_io_dma_abort() {
+    USB_IO_DMA_CHANNEL->CCR = 0;
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    usb_io_dma.busy = 0;
+}
+
+static int usb_io_dma_is_reading(uint8_t ep_num) {
+    return usb_io_dma.busy && usb_io_dma.read && (usb_io_dma.ep_num == ep_num);
+}
+
+static int usb_io_dma_is_sending(uint8_t ep_num) {
+    return usb_io_dma.busy && !usb_io_dma.read && (usb_io_dma.ep_num == ep_num);
+}
+
+static void usb_io_dma_start(uint32_t pb_addr, uint8_t *buf, size_t words) {
+    uint32_t ccr = DMA_CCR1_MEM2MEM | DMA_CCR1_PL_0 | DMA_CCR1_MSIZE_0 | DMA_CCR1_PSIZE_1 |
+                   DMA_CCR1_MINC | DMA_CCR1_PINC | DMA_CCR1_TCIE;
+    if (!usb_io_dma.read) {
+        ccr |= DMA_CCR1_DIR;
+    }
+    USB_IO_DMA_CHANNEL->CCR = 0;
+    USB_IO_DMA_CHANNEL->CPAR = pb_addr;
+    USB_IO_DMA_CHANNEL->CMAR = (uint32_t)buf;
+    USB_IO_DMA_CHANNEL->CNDTR = words;
+    USB_IO_DMA_CHANNEL->CCR = ccr | DMA_CCR1_EN;
+}
+
+/*
+ * Claims the channel and starts copying count bytes between the packet buffer
+ * at pb_addr and the ring, at the head when reading and at the tail when sending.
+ * pb_count is the byte count register of the packet buffer. Returns 0 if the
+ * channel is busy or the transfer cannot be done with half-word accesses.
+ */
+static int usb_io_dma_copy(uint8_t ep_num, int read, uint32_t pb_addr, volatile pb_aligned_word_t *pb_count,
+                           ring_buf_t *buf, size_t count) {
+    size_t span_size, next_span_size;
+    uint8_t *span = read ? ring_buf_peek_write(buf, 0, &span_size) : ring_buf_peek_read(buf, 0, &span_size);
+    uint8_t *next_span;
+    uint32_t primask;
+    if (span_size > count) {
+        span_size = count;
+    }
+    if ((count < USB_IO_DMA_MIN_SIZE) || ((uint32_t)span & 0x01) || ((span_size != count) && (span_size & 0x01))) {
+        return 0;
+    }
+    next_span = read ? ring_buf_peek_write(buf, span_size, &next_span_size) : ring_buf_peek_read(buf, span_size, &next_span_size);
+    /* Interrupt handlers check ep_num and read once busy is set, so they are set first */
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (usb_io_dma.busy) {
+        __set_PRIMASK(primask);
+        return 0;
+    }
+    usb_io_dma.ep_num = ep_num;
+    usb_io_dma.read = read;
+    usb_io_dma.busy = 1;
+    __set_PRIMASK(primask);
+    usb_io_dma.buf = buf;
+    usb_io_dma.count = count;
+    usb_io_dma.next_span = next_span;
+    usb_io_dma.next_pb_addr = pb_addr + (span_size << 1);
+    usb_io_dma.next_words = (count - span_size) >> 1;
+    if (!read) {
+        *pb_count = count;
+    } else if (!usb_endpoints[ep_num].double_buffered) {
+        *pb_count &= ~USB_COUNT0_RX_COUNT0_RX;
+    }
+    if (count & 0x01) {
+        uint8_t *last = (span_size == count) ? &span[count - 1] : &next_span[count - span_size - 1];
+        volatile usb_pbuffer_data_t *ep_buf = (usb_pbuffer_data_t *)pb_addr;
+        if (read) {
+            usb_pb_read_span(last, ep_buf, count - 1, 1);
+        } else {
+            usb_pb_write_span(ep_buf, count - 1, last, 1);
+        }
+    }
+    usb_io_dma_start(pb_addr, span, span_size >> 1);
+    return 1;
+}
+
+RAMFUNC size_t usb_ring_buf_read_dma(uint8_t ep_num, ring_buf_t *buf) {
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *rx_count = usb_io_rx_buf(ep_num, &pb_addr);
+    pb_word_t ep_bytes_count = usb_bytes_available(ep_num);
+    if (usb_io_dma_copy(ep_num, 1, pb_addr, rx_count, buf, ep_bytes_count)) {
+        return ep_bytes_count;
+    }
+    return usb_ring_buf_read(ep_num, buf);
+}
+
+size_t usb_ring_buf_send_dma(uint8_t ep_num, ring_buf_t *buf) {
+    uint32_t pb_addr;
+    volatile pb_aligned_word_t *tx_count = usb_io_tx_buf(ep_num, &pb_addr);
+    size_t count = ring_buf_count(buf);
+    size_t tx_space_available = usb_endpoints[ep_num].tx_size;
+    if (count > tx_space_available) {
+        count = tx_space_available;
+    }
+    if (usb_io_dma_copy(ep_num, 0, pb_addr, tx_count, buf, count)) {
+        return count;
+    }
+    return usb_ring_buf_send(ep_num, buf);
+}
+
+void usb_ring_buf_dma_wait() {
+    while (usb_io_dma.busy);
+}
+
+RAMFUNC void DMA1_Channel1_IRQHandler() {
+    (void)DMA1_Channel1_IRQHandler;
+    SYSTEM_PROFILE_START(profile_start);
+    uint8_t ep_num = usb_io_dma.ep_num;
+    ring_buf_t *buf = usb_io_dma.buf;
+    DMA1->IFCR = DMA_IFCR_CGIF1;
+    if (!usb_io_dma.busy) {
+        return;
+    }
+    if (usb_io_dma.next_words) {
+        size_t words = usb_io_dma.next_words;
+        usb_io_dma.next_words = 0;
+        usb_io_dma_start(usb_io_dma.next_pb_addr, usb_io_dma.next_span, words);
+        return;
+    }
+    USB_IO_DMA_CHANNEL->CCR = 0;
+    if (usb_io_dma.read) {
+        ring_buf_commit_write(buf, usb_io_dma.count);
+        usb_io_rx_release(ep_num);
+    } else {
+        ring_buf_commit_read(buf, usb_io_dma.count);
+        usb_io_tx_release(ep_num);
+    }
+    usb_io_dma.busy = 0;
+    if (usb_io_dma.read && usb_endpoints[ep_num].event_handler) {
+        usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_copied);
+    }
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usb_dma_copy);
+}
+
 /* Endpoint Stall */
 
 void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_direction, uint8_t ep_stall) {
@@ -192,6 +599,11 @@ void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_directio
             if ((*ep_reg & USB_EPTX_STAT) != USB_EP_TX_DIS) {
                 if (ep_stall) {
                     *ep_reg = ((*ep_reg ^ USB_EP_TX_STALL) & (USB_EPREG_MASK | USB_EPTX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                } else if (usb_endpoints[ep_num].double_buffered) {
+                    usb_io_dbl_buf[ep_num].tx_busy = 0;
+                    usb_io_dbl_buf[ep_num].tx_queued = 0;
+                    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) &
+                               (USB_EPREG_MASK | USB_EPTX_STAT | USB_EP_DTOG_TX | USB_EP_DTOG_RX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
                 } else {
                     *ep_reg = ((*ep_reg ^ USB_EP_TX_NAK) & (USB_EPREG_MASK | USB_EPTX_STAT | USB_EP_DTOG_TX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
                 }
@@ -200,8 +612,22 @@ void usb_endpoint_set_stall(uint8_t ep_num, usb_endpoint_direction_t ep_directio
             if ((*ep_reg & USB_EPRX_STAT) != USB_EP_RX_DIS) {
                 if (ep_stall) {
                     *ep_reg = ((*ep_reg ^ USB_EP_RX_STALL) & (USB_EPREG_MASK | USB_EPRX_STAT)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                } else if (usb_endpoints[ep_num].double_buffered) {
+                    /*
+                     * Drop the held packet and its copy in progress. As after reset, the peripheral
+                     * receives DATA0 into buffer 0 and SW_BUF (DTOG_TX) selects buffer 1.
+                     */
+                    uint32_t primask = __get_PRIMASK();
+                    __disable_irq();
+                    if (usb_io_dma_is_reading(ep_num)) {
+                        usb_io_dma_abort();
+                    }
+                    usb_io_dbl_buf[ep_num].rx_held = 0;
+                    *ep_reg = ((*ep_reg ^ (USB_EP_RX_VALID | USB_EP_DTOG_TX)) &
+                               (USB_EPREG_MASK | USB_EPRX_STAT | USB_EP_DTOG_RX | USB_EP_DTOG_TX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                    __set_PRIMASK(primask);
                 } else {
-                    *ep_reg = ((*ep_reg ^ USB_EP_TX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT | USB_EP_DTOG_RX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
+                    *ep_reg = ((*ep_reg ^ USB_EP_RX_VALID) & (USB_EPREG_MASK | USB_EPRX_STAT | USB_EP_DTOG_RX)) | (USB_EP_CTR_RX | USB_EP_CTR_TX);
                 }
             }
         }
@@ -221,46 +647,160 @@ static uint8_t usb_transfer_led_timer = 0;
 
 uint16_t istr;
 
-void usb_poll() {
-    istr = USB->ISTR;
-    if (istr & USB_ISTR_CTR) {
-        uint8_t ep_num = USB->ISTR & USB_ISTR_EP_ID;
-        ep_reg_t *ep_reg = ep_regs(ep_num);
-        if (*ep_reg & USB_EP_CTR_TX) {
-            *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_RX);
-            if (usb_endpoints[ep_num].event_handler) {
-                usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_sent);
-            }
-        } else {
-            usb_endpoint_event_t ep_event = usb_endpoint_event_data_received;
-            if (*ep_reg & USB_EP_SETUP) {
-                ep_event = usb_endpoint_event_setup;
-            }
-            *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_TX);
-            if (usb_endpoints[ep_num].event_handler) {
-                usb_endpoints[ep_num].event_handler(ep_num, ep_event);
-            }
+/* USB Transfer Statistics */
+
+static usb_io_stats_t usb_io_stats;
+static uint32_t usb_io_frame_packets;
+
+const usb_io_stats_t *usb_io_get_stats() {
+    return &usb_io_stats;
+}
+
+void usb_io_reset_stats() {
+    usb_io_stats.frame_packets_peak = 0;
+    usb_io_stats.poll_packets_peak = 0;
+}
+
+static void usb_io_handle_ctr() {
+    SYSTEM_PROFILE_START(profile_start);
+    uint8_t ep_num = USB->ISTR & USB_ISTR_EP_ID;
+    ep_reg_t *ep_reg = ep_regs(ep_num);
+    if (*ep_reg & USB_EP_CTR_TX) {
+        *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_RX);
+        usb_trace_record(usb_trace_event_data_sent, ep_num, usb_io_tx_sent_count(ep_num));
+        if (usb_endpoints[ep_num].double_buffered) {
+            usb_io_tx_complete(ep_num);
+        }
+        if (usb_endpoints[ep_num].event_handler) {
+            usb_endpoints[ep_num].event_handler(ep_num, usb_endpoint_event_data_sent);
+        }
+    } else {
+        usb_endpoint_event_t ep_event = usb_endpoint_event_data_received;
+        if (*ep_reg & USB_EP_SETUP) {
+            ep_event = usb_endpoint_event_setup;
         }
-        usb_transfer_led_timer = USB_TRANSFER_LED_TIME;
-        status_led_set(1);
-    } else if (istr & USB_ISTR_RESET) {
+        *ep_reg = ((*ep_reg & (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)) | USB_EP_CTR_TX);
+        if (usb_endpoints[ep_num].double_buffered) {
+            usb_io_rx_take(ep_num);
+        }
+        usb_trace_record((usb_trace_event_t)ep_event, ep_num, usb_bytes_available(ep_num));
+        if (usb_endpoints[ep_num].event_handler) {
+            usb_endpoints[ep_num].event_handler(ep_num, ep_event);
+        }
+    }
+    usb_io_frame_packets++;
+    usb_transfer_led_timer = USB_TRANSFER_LED_TIME;
+    status_led_set(1);
+    SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usb_ctr);
+}
+
+/*
+ * Services all pending transfers first, then the pending bus events.
+ * A transfer completing on every endpoint while the pass runs cannot keep
+ * the loop going for more than USB_POLL_MAX_CTR_EVENTS transfers.
+ */
+static int usb_io_handle_events() {
+    int busy = 0;
+    int ctr_events = 0;
+    while ((USB->ISTR & USB_ISTR_CTR) && (ctr_events < USB_POLL_MAX_CTR_EVENTS)) {
+        usb_io_handle_ctr();
+        ctr_events++;
+    }
+    if (ctr_events > usb_io_stats.poll_packets_peak) {
+        usb_io_stats.poll_packets_peak = ctr_events;
+    }
+    busy = (ctr_events != 0);
+    istr = USB->ISTR;
+    if (istr & USB_ISTR_RESET) {
         USB->ISTR = (uint16_t)(~USB_ISTR_RESET);
-        usb_device_handle_reset();   
-    } else if (istr & USB_ISTR_SUSP) {
+        usb_trace_record(usb_trace_event_reset, 0, 0);
+        usb_io_dma_abort();
+        usb_device_handle_reset();
+        busy = 1;
+    }
+    if (istr & USB_ISTR_SUSP) {
         USB->ISTR = (uint16_t)(~USB_ISTR_SUSP);
+        usb_trace_record(usb_trace_event_suspend, 0, 0);
         USB->CNTR |= USB_CNTR_FSUSP;
         status_led_set(0);
         usb_device_handle_suspend();
-    } else if (istr & USB_ISTR_WKUP) {
+        busy = 1;
+    }
+    if (istr & USB_ISTR_WKUP) {
         USB->ISTR = (uint16_t)(~USB_ISTR_WKUP);
+        usb_trace_record(usb_trace_event_wakeup, 0, 0);
         USB->CNTR &= ~USB_CNTR_FSUSP;
         usb_device_handle_wakeup();
-    } else if (istr & USB_ISTR_SOF) {
+        busy = 1;
+    }
+    if (istr & USB_ISTR_SOF) {
+        SYSTEM_PROFILE_START(profile_start);
         USB->ISTR = (uint16_t)(~USB_ISTR_SOF);
+        if (usb_io_frame_packets > usb_io_stats.frame_packets_peak) {
+            usb_io_stats.frame_packets_peak = usb_io_frame_packets;
+        }
+        usb_io_frame_packets = 0;
         if (usb_transfer_led_timer) {
             status_led_set(--usb_transfer_led_timer);
         }
         usb_device_handle_frame();
+        SYSTEM_PROFILE_STOP(profile_start, system_profile_point_usb_sof);
+        busy = 1;
     }
-    usb_device_poll();
+    return busy;
 }
+
+#if defined(USB_INTERRUPT_DRIVEN)
+
+/*
+ * USB events are handled by the low-priority USB interrupt handler. usb_poll
+ * masks it while the device polls ports, so endpoint event handlers and
+ * usb_device_poll never preempt each other, as in the polling mode.
+ */
+
+static volatile uint8_t usb_io_irq_events = 0;
+
+void USB_LP_CAN1_RX0_IRQHandler() {
+    (void)USB_LP_CAN1_RX0_IRQHandler;
+    if (usb_io_handle_events()) {
+        usb_io_irq_events = 1;
+    }
+}
+
+int usb_poll() {
+    int busy = usb_io_irq_events;
+    usb_io_irq_events = 0;
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    busy |= usb_device_poll();
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+    return busy;
+}
+
+RAMFUNC void usb_wake() {
+    usb_io_irq_events = 1;
+}
+
+void usb_wait_for_events() {
+    /* WFI wakes up on a pending interrupt while interrupts are masked */
+    __disable_irq();
+    if (!usb_io_irq_events) {
+        __WFI();
+    }
+    __enable_irq();
+}
+
+#else
+
+int usb_poll() {
+    int busy = usb_io_handle_events();
+    busy |= usb_device_poll();
+    return busy;
+}
+
+RAMFUNC void usb_wake() {
+}
+
+void usb_wait_for_events() {
+}
+
+#endif /* USB_INTERRUPT_DRIVEN */
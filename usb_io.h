@@ -11,7 +11,7 @@
 
 #include <stddef.h>
 #include "stm32f10x.h"
-#include "circ_buf.h"
+#include "ring_buf.h"
 #include "usb.h"
 #include "usb_std.h"
 #include "usb_core.h"
@@ -34,7 +34,11 @@ typedef struct {
     pb_aligned_word_t data;
 } usb_pbuffer_data_t;
 
-#define USB_BTABLE_SIZE (sizeof(usb_btable_entity_t) * USB_NUM_ENDPOINTS)
+#define USB_PMA_SIZE    512 /* bytes */
+/* Packet memory bytes, each half-word of the buffer table takes a 32-bit word in the CPU address space */
+#define USB_BTABLE_SIZE ((sizeof(usb_btable_entity_t) / (USB_PACKET_BUFFER_ALIGNMENT / sizeof(pb_word_t))) * USB_NUM_ENDPOINTS)
+/* Packet memory used by the buffers of an endpoint, double-buffered endpoints use twice the size */
+#define USB_PMA_BUFFERS_SIZE(rx_size, tx_size, double_buffered) (((rx_size) + (tx_size)) * ((double_buffered) ? 2 : 1))
 #define USB_BTABLE_SMALL_BLOCK_SIZE (sizeof(uint16_t))
 #define USB_BTABLE_LARGE_BLOCK_SIZE (USB_BTABLE_SMALL_BLOCK_SIZE<<4)
 #define USB_BTABLE_SMALL_BLOCK_SIZE_LIMIT ((USB_COUNT0_RX_NUM_BLOCK>>USB_COUNT0_RX_NUM_BLOCK_Pos)<<1)
@@ -50,6 +54,7 @@ typedef enum {
     usb_endpoint_event_data_received    = 0x01,
     usb_endpoint_event_data_sent        = 0x02,
     usb_endpoint_event_setup            = 0x03,
+    usb_endpoint_event_data_copied      = 0x04, /* usb_ring_buf_read_dma completed, sent from DMA interrupt handler */
 } usb_endpoint_event_t;
 
 /* USB Endpoint Definition */
@@ -60,6 +65,8 @@ typedef struct {
     uint32_t    type;
     uint8_t     rx_size;
     uint8_t     tx_size;
+    uint8_t     double_buffered; /* bulk only, either rx_size or tx_size must be 0 */
+    uint16_t    pma_offset; /* packet memory bytes, tx buffer (buffer 0) first, then rx buffer (buffer 1) */
     usb_endpoint_event_handler_t event_handler;
 } usb_endpoint_t;
 
@@ -73,6 +80,8 @@ void usb_io_reset(void);
 
 /* Get Number of RX/TX Bytes Available  */
 
+/* Returns 1 if the application holds a received packet, possibly empty, that no DMA copy is reading */
+int usb_rx_ready(uint8_t ep_num);
 size_t usb_bytes_available(uint8_t ep_num);
 size_t usb_space_available(uint8_t ep_num);
 
@@ -81,12 +90,45 @@ size_t usb_space_available(uint8_t ep_num);
 int usb_read(uint8_t ep_num, void *buf, size_t buf_size);
 size_t usb_send(uint8_t ep_num, const void *buf, size_t count);
 
-/* Circular Buffer Read/Write Operations */
+/* Ring Buffer Read/Write Operations, the endpoint is the ring producer (read) or consumer (send) */
 
-/* NOTE: usb_circ_buf_read assumes enough buffer space is available */
-size_t usb_circ_buf_read(uint8_t ep_num, circ_buf_t *buf, size_t buf_size);
-/* NOTE: usb_circ_buf_send assumes endpoint is ready to send */
-size_t usb_circ_buf_send(uint8_t ep_num, circ_buf_t *buf, size_t buf_size);
+/* NOTE: usb_ring_buf_read assumes enough buffer space is available */
+size_t usb_ring_buf_read(uint8_t ep_num, ring_buf_t *buf);
+/* NOTE: usb_ring_buf_send assumes endpoint is ready to send */
+size_t usb_ring_buf_send(uint8_t ep_num, ring_buf_t *buf);
+
+/* Ring Buffer DMA Read/Write Operations */
+
+#define USB_IO_DMA_MIN_SIZE 16 /* bytes, shorter packets are copied by the CPU */
+
+/*
+ * Same as usb_ring_buf_read/usb_ring_buf_send, but copy the packet with
+ * DMA1 Channel 1 if it is free and the buffer position is half-word aligned.
+ * Otherwise the packet is copied by the CPU before returning.
+ *
+ * A DMA copy returns immediately. The buffer head (read) or tail (send) is
+ * advanced and the endpoint is enabled once the copy is complete, then a read
+ * sends usb_endpoint_event_data_copied to the endpoint event handler from the
+ * DMA interrupt handler. The endpoint reports no data or space until then.
+ */
+size_t usb_ring_buf_read_dma(uint8_t ep_num, ring_buf_t *buf);
+size_t usb_ring_buf_send_dma(uint8_t ep_num, ring_buf_t *buf);
+/* Waits for a DMA copy in progress to complete, must not be called from interrupt handlers */
+void usb_ring_buf_dma_wait(void);
+
+/* USB Polling */
+
+#define USB_POLL_MAX_CTR_EVENTS (2 * USB_MAX_ENDPOINTS) /* transfers serviced per usb_poll call */
+
+/* USB Transfer Statistics */
+
+typedef struct {
+    uint32_t    frame_packets_peak; /* max transfers completed within a frame */
+    uint32_t    poll_packets_peak;  /* max transfers serviced by a usb_poll call */
+} usb_io_stats_t;
+
+const usb_io_stats_t *usb_io_get_stats(void);
+void usb_io_reset_stats(void);
 
 /* Endpoint Stall */
 
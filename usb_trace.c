@@ -0,0 +1,61 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include "stm32f10x.h"
+#include "usb_core.h"
+#include "usb_trace.h"
+
+/*
+ * Events are recorded from usb_poll only. The ring keeps the latest
+ * USB_TRACE_SIZE entries, head is the total number of entries recorded.
+ */
+
+static struct {
+    usb_trace_entry_t   entries[USB_TRACE_SIZE];
+    uint32_t            head;
+    uint8_t             running;
+} usb_trace = {
+    .running = 1,
+};
+
+void usb_trace_record(usb_trace_event_t event, uint8_t ep_num, size_t count) {
+    if (usb_trace.running) {
+        usb_trace_entry_t *entry = &usb_trace.entries[usb_trace.head & (USB_TRACE_SIZE - 1)];
+        entry->frame = USB->FNR & USB_FNR_FN;
+        entry->count = count;
+        entry->ep = ep_num;
+        entry->event = event;
+        entry->reserved = 0;
+        usb_trace.head++;
+    }
+}
+
+void usb_trace_start() {
+    usb_trace.running = 1;
+}
+
+void usb_trace_stop() {
+    usb_trace.running = 0;
+}
+
+void usb_trace_clear() {
+    usb_trace.head = 0;
+}
+
+int usb_trace_is_running() {
+    return usb_trace.running;
+}
+
+size_t usb_trace_count() {
+    return (usb_trace.head < USB_TRACE_SIZE) ? usb_trace.head : USB_TRACE_SIZE;
+}
+
+const usb_trace_entry_t *usb_trace_get(size_t index) {
+    if (index < usb_trace_count()) {
+        return &usb_trace.entries[(usb_trace.head - usb_trace_count() + index) & (USB_TRACE_SIZE - 1)];
+    }
+    return 0;
+}
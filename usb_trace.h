@@ -0,0 +1,44 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef USB_TRACE_H
+#define USB_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* USB Event Trace */
+
+#define USB_TRACE_SIZE  256 /* entries, must be a power of 2 */
+
+typedef enum {
+    usb_trace_event_data_received   = 0x01, /* CTR_RX, same values as usb_endpoint_event_t */
+    usb_trace_event_data_sent       = 0x02, /* CTR_TX */
+    usb_trace_event_setup           = 0x03, /* CTR_RX with SETUP */
+    usb_trace_event_reset           = 0x04,
+    usb_trace_event_suspend         = 0x05,
+    usb_trace_event_wakeup          = 0x06,
+} usb_trace_event_t;
+
+typedef struct {
+    uint32_t    frame:11;   /* SOF frame number the event was handled in */
+    uint32_t    count:10;   /* bytes received or sent */
+    uint32_t    ep:3;
+    uint32_t    event:3;
+    uint32_t    reserved:5;
+} __attribute__ ((packed)) usb_trace_entry_t;
+
+void usb_trace_record(usb_trace_event_t event, uint8_t ep_num, size_t count);
+
+void usb_trace_start(void);
+void usb_trace_stop(void);
+void usb_trace_clear(void);
+int usb_trace_is_running(void);
+
+size_t usb_trace_count(void);
+const usb_trace_entry_t *usb_trace_get(size_t index); /* 0 is the oldest entry */
+
+#endif /* USB_TRACE_H */
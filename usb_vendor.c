@@ -0,0 +1,66 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#include "usb_std.h"
+#include "system_load.h"
+#include "usb_vendor.h"
+
+static union {
+    usb_vendor_load_t       load;
+    usb_vendor_counters_t   counters;
+} usb_vendor_payload;
+
+static void usb_vendor_get_counters(usb_vendor_counters_t *counters) {
+    counters->version = USB_VENDOR_COUNTERS_VERSION;
+    counters->num_ports = USB_CDC_NUM_PORTS;
+    counters->port_counters_size = sizeof(usb_vendor_port_counters_t);
+    for (int port = 0; port < USB_CDC_NUM_PORTS; port++) {
+        const usb_cdc_port_stats_t *stats = usb_cdc_get_port_stats(port);
+        usb_vendor_port_counters_t *port_counters = &counters->port_counters[port];
+        port_counters->rx_bytes = stats->rx_bytes;
+        port_counters->tx_bytes = stats->tx_bytes;
+        port_counters->rx_rate = stats->rx_rate;
+        port_counters->tx_rate = stats->tx_rate;
+        port_counters->rx_overruns = stats->rx_overruns;
+        port_counters->rx_parity_errors = stats->rx_parity_errors;
+        port_counters->rx_buf_peak = stats->rx_buf_peak;
+        port_counters->tx_buf_peak = stats->tx_buf_peak;
+        port_counters->rx_deferred = stats->rx_deferred;
+        port_counters->rts_throttled = stats->rts_throttled;
+        port_counters->rx_zlps = stats->rx_zlps;
+        port_counters->rx_framing_errors = stats->rx_framing_errors;
+        port_counters->rx_noise_errors = stats->rx_noise_errors;
+        port_counters->rx_usart_overruns = stats->rx_usart_overruns;
+        port_counters->rx_overrun_bytes = stats->rx_overrun_bytes;
+        port_counters->rx_buf_grows = stats->rx_buf_grows;
+        port_counters->rx_buf_shrinks = stats->rx_buf_shrinks;
+        port_counters->rx_buf_grow_failures = stats->rx_buf_grow_failures;
+    }
+}
+
+usb_status_t usb_vendor_ctrl_process_request(usb_setup_t *setup, void **payload,
+                                             size_t *payload_size, usb_tx_complete_cb_t *tx_callback_ptr) {
+    if ((setup->type == usb_setup_type_vendor) &&
+        (setup->recepient == usb_setup_recepient_device) &&
+        (setup->direction == usb_setup_direction_device_to_host)) {
+        switch (setup->bRequest) {
+        case usb_vendor_request_get_load:
+            usb_vendor_payload.load.load = system_load_get();
+            usb_vendor_payload.load.peak = system_load_get_peak();
+            *payload = &usb_vendor_payload.load;
+            *payload_size = sizeof(usb_vendor_payload.load);
+            return usb_status_ack;
+        case usb_vendor_request_get_counters:
+            usb_vendor_get_counters(&usb_vendor_payload.counters);
+            *payload = &usb_vendor_payload.counters;
+            *payload_size = sizeof(usb_vendor_payload.counters);
+            return usb_status_ack;
+        default:
+            ;
+        }
+    }
+    return usb_status_fail;
+}
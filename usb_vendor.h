@@ -0,0 +1,70 @@
+/*
+ * MIT License 
+ * 
+ * Copyright (c) 2020 Kirill Kotyagin
+ */
+
+#ifndef USB_VENDOR_H
+#define USB_VENDOR_H
+
+#include <stdint.h>
+#include "usb_core.h"
+#include "usb_cdc.h"
+
+/* Vendor-Specific Device Requests */
+
+typedef enum {
+    usb_vendor_request_get_load     = 0x01,
+    usb_vendor_request_get_counters = 0x02,
+} __attribute__ ((packed)) usb_vendor_request_t;
+
+/* usb_vendor_request_get_load Payload */
+
+typedef struct {
+    uint8_t     load;   /* percent, over the last second */
+    uint8_t     peak;   /* percent, since startup or the last "load reset" */
+} __attribute__ ((packed)) usb_vendor_load_t;
+
+/* usb_vendor_request_get_counters Payload */
+
+#define USB_VENDOR_COUNTERS_VERSION     3
+
+/*
+ * New fields are only ever appended to usb_vendor_port_counters_t,
+ * hosts should use port_counters_size to step over the port entries.
+ */
+
+typedef struct {
+    uint32_t    rx_bytes;
+    uint32_t    tx_bytes;
+    uint32_t    rx_rate;
+    uint32_t    tx_rate;
+    uint32_t    rx_overruns;
+    uint32_t    rx_parity_errors;
+    uint32_t    rx_buf_peak;
+    uint32_t    tx_buf_peak;
+    uint32_t    rx_deferred;
+    uint32_t    rts_throttled;
+    uint32_t    rx_zlps;
+    uint32_t    rx_framing_errors;  /* version 2 */
+    uint32_t    rx_noise_errors;    /* version 2 */
+    uint32_t    rx_usart_overruns;  /* version 2 */
+    uint32_t    rx_overrun_bytes;   /* version 3 */
+    uint32_t    rx_buf_grows;       /* version 3 */
+    uint32_t    rx_buf_shrinks;     /* version 3 */
+    uint32_t    rx_buf_grow_failures; /* version 3 */
+} __attribute__ ((packed)) usb_vendor_port_counters_t;
+
+typedef struct {
+    uint8_t                     version;
+    uint8_t                     num_ports;
+    uint16_t                    port_counters_size;
+    usb_vendor_port_counters_t  port_counters[USB_CDC_NUM_PORTS];
+} __attribute__ ((packed)) usb_vendor_counters_t;
+
+/* Control Endpoint Request Processing */
+
+usb_status_t usb_vendor_ctrl_process_request(usb_setup_t *setup, void **payload,
+                                             size_t *payload_size, usb_tx_complete_cb_t *tx_callback_ptr);
+
+#endif /* USB_VENDOR_H */